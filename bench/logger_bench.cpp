@@ -0,0 +1,298 @@
+/*
+ * logger_bench.cpp
+ * Copyright (c) 2025 João Pedro Foscarini
+ * SPDX-License-Identifier: MIT
+ *
+ * This file is licensed under the MIT License.
+ * You may obtain a copy of the license at:
+ * https://opensource.org/licenses/MIT
+ */
+
+// Hot path benchmarks for the logger headers: per-call latency percentiles,
+// throughput and heap allocations per call, in synchronous and asynchronous
+// mode with 1 to 64 threads. Records go to a sink that formats them like a
+// file sink and drops the bytes, so the numbers leave out the disk. Build it
+// once per header and compare the tables:
+//
+//   g++ -std=c++11 -O2 -pthread -I. bench/logger_bench.cpp -o bench11
+//   g++ -std=c++23 -O2 -pthread -I. -DLOG_BENCH_CPP23 bench/logger_bench.cpp
+//       -o bench23
+//
+// Usage: bench11 [calls per case, 1000000] [case name filter]
+//
+// Latencies include one steady_clock read, shown by the "clock" case. A case
+// that logs but is not slower than "clock" makes the run fail, as its
+// statement was compiled out.
+
+// Release builds define NDEBUG, which would strip the statements under test.
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+
+#ifdef LOG_BENCH_CPP23
+#include "logger_cpp23.hpp"
+#define LOG_BENCH_HEADER "cpp23"
+#else
+#include "logger_cpp11.hpp"
+#define LOG_BENCH_HEADER "cpp11"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::atomic<unsigned long long> allocations(0);
+std::atomic<unsigned long long> allocated_bytes(0);
+
+} // namespace
+
+// Every heap allocation of the process is counted, the writer thread's too.
+// GCC takes the malloc() below for a mismatch with the delete operators.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  if (void *data = std::malloc(size != 0 ? size : 1))
+    return data;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *data) noexcept { std::free(data); }
+void operator delete(void *data, std::size_t) noexcept { std::free(data); }
+
+namespace {
+
+class NullSink : public log::Sink {
+public:
+  void write(const log::Record &record) {
+    format(m_line, record, false);
+    m_line.clear();
+  }
+
+private:
+  log::detail::LineBuffer m_line;
+};
+
+const std::string service = "frontend";
+
+void clock_only(unsigned) {}
+
+void disabled(unsigned i) { log_debug() << "disabled " << i; }
+
+void literal(unsigned) { log_info() << "short literal message"; }
+
+void mixed(unsigned i) {
+  log_info() << "request " << i << " took " << i * 0.25 << "ms on " << service;
+}
+
+void category(unsigned i) { log_info(BENCH) << "request " << i; }
+
+#ifdef LOG_BENCH_CPP23
+void formatted(unsigned i) {
+  log_info(BENCH, "request {} took {}ms on {}", i, i * 0.25, service);
+}
+#endif
+
+void deferred(unsigned i) {
+  log_deferred_info() << "request " << i << " took " << i * 0.25 << "ms on "
+                      << service;
+}
+
+void context(unsigned i) {
+  log::Context request("request", i);
+  log_info() << "request " << i;
+}
+
+void limited(unsigned i) { log_limited(1000, Info) << "request " << i; }
+
+void scope(unsigned) { log_profile(bench_scope); }
+
+void filter_info(bool on) {
+  log::set_level(on ? log::Level::Info : log::Level::Trace);
+}
+
+void backtrace(bool on) {
+  filter_info(on);
+  if (on)
+    log::enable_backtrace(log::Level::Debug);
+  else
+    log::disable_backtrace();
+}
+
+void aggregate(bool on) {
+  log::set_profile_mode(on ? log::ProfileMode::Aggregate
+                           : log::ProfileMode::Lines);
+}
+
+struct Case {
+  const char *name;
+  void (*call)(unsigned);
+  void (*setup)(bool on); // may be null
+  bool logs; // every call writes a record or times a scope
+};
+
+const Case cases[] = {
+    {"clock", clock_only, 0, false},
+    {"disabled", disabled, filter_info, false},
+    {"literal", literal, 0, true},
+    {"mixed", mixed, 0, true},
+    {"category", category, 0, true},
+    {"deferred", deferred, 0, true},
+    {"limited", limited, 0, false},
+    {"scope", scope, aggregate, true},
+    {"lines", scope, 0, true},
+    {"context", context, 0, true},
+    {"backtrace", disabled, backtrace, true},
+#ifdef LOG_BENCH_CPP23
+    {"format", formatted, 0, true},
+#endif
+};
+
+const unsigned thread_counts[] = {1, 4, 16, 64};
+
+struct Result {
+  double calls_per_second;
+  std::uint64_t p50, p99, p999, max; // nanoseconds
+  double allocations;                // per call
+  double bytes;                      // per call
+};
+
+std::uint64_t now() {
+  return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch())
+          .count());
+}
+
+// Runs calls of a case spread over threads. Each thread first makes a few
+// unmeasured calls, so per-thread buffers and interned categories are in
+// place before counting starts.
+Result run(const Case &test, unsigned threads, unsigned calls) {
+  const unsigned warmup = 64;
+  unsigned per_thread = std::max(calls / threads, 1u);
+  std::vector<std::vector<std::uint32_t> > latencies(
+      threads, std::vector<std::uint32_t>(per_thread));
+  std::atomic<unsigned> ready(0);
+  std::atomic<unsigned> done(0);
+  std::atomic<bool> go(false);
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; ++t)
+    workers.emplace_back([&, t]() {
+      for (unsigned i = 0; i < warmup; ++i)
+        test.call(i);
+      ready.fetch_add(1);
+      while (!go.load())
+        std::this_thread::yield();
+      std::uint32_t *out = latencies[t].data();
+      for (unsigned i = 0; i < per_thread; ++i) {
+        std::uint64_t start = now();
+        test.call(i);
+        out[i] = static_cast<std::uint32_t>(
+            std::min<std::uint64_t>(now() - start, 0xffffffffu));
+      }
+      done.fetch_add(1);
+    });
+
+  while (ready.load() != threads)
+    std::this_thread::yield();
+  unsigned long long allocations_before = allocations.load();
+  unsigned long long bytes_before = allocated_bytes.load();
+  std::uint64_t start = now();
+  go.store(true);
+  while (done.load() != threads)
+    std::this_thread::yield();
+  std::uint64_t elapsed = now() - start;
+  unsigned long long allocations_after = allocations.load();
+  unsigned long long bytes_after = allocated_bytes.load();
+  for (std::size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  log::flush();
+
+  std::vector<std::uint32_t> all;
+  all.reserve(static_cast<std::size_t>(per_thread) * threads);
+  for (std::size_t t = 0; t < latencies.size(); ++t)
+    all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+  std::sort(all.begin(), all.end());
+
+  double total = static_cast<double>(all.size());
+  Result result;
+  result.calls_per_second = total * 1e9 / static_cast<double>(elapsed);
+  result.p50 = all[all.size() / 2];
+  result.p99 = all[static_cast<std::size_t>(total * 0.99)];
+  result.p999 = all[static_cast<std::size_t>(total * 0.999)];
+  result.max = all.back();
+  result.allocations =
+      static_cast<double>(allocations_after - allocations_before) / total;
+  result.bytes = static_cast<double>(bytes_after - bytes_before) / total;
+  return result;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned calls = 1000000;
+  if (argc > 1 && std::strtoul(argv[1], 0, 10) != 0)
+    calls = static_cast<unsigned>(std::strtoul(argv[1], 0, 10));
+  const char *filter = argc > 2 ? argv[2] : "";
+
+  log::clear_sinks();
+  log::add_sink(std::make_shared<NullSink>());
+
+  int status = 0;
+  std::printf("%-6s %-6s %-9s %7s %12s %7s %7s %7s %9s %9s %9s\n", "header",
+              "mode", "case", "threads", "calls/s", "p50", "p99", "p99.9",
+              "max", "allocs", "bytes");
+  for (int async = 0; async < 2; ++async) {
+    if (async) {
+      log::AsyncOptions options;
+      options.thread_buffer_size = 1024 * 1024;
+      log::start_async(options);
+    }
+    Result clock = run(cases[0], 1, calls);
+    for (std::size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+      const Case &test = cases[c];
+      if (!std::strstr(test.name, filter))
+        continue;
+      if (test.setup)
+        test.setup(true);
+      for (std::size_t i = 0; i < sizeof(thread_counts) / sizeof(unsigned);
+           ++i) {
+        Result r = run(test, thread_counts[i], calls);
+        std::printf("%-6s %-6s %-9s %7u %12.0f %7llu %7llu %7llu %9llu %9.3f "
+                    "%9.1f\n",
+                    LOG_BENCH_HEADER, async ? "async" : "sync", test.name,
+                    thread_counts[i], r.calls_per_second,
+                    static_cast<unsigned long long>(r.p50),
+                    static_cast<unsigned long long>(r.p99),
+                    static_cast<unsigned long long>(r.p999),
+                    static_cast<unsigned long long>(r.max), r.allocations,
+                    r.bytes);
+        std::fflush(stdout);
+        if (test.logs && thread_counts[i] == 1 && r.p50 <= clock.p50) {
+          std::fprintf(stderr,
+                       "%s: p50 of %llu ns is no more than the %llu ns of "
+                       "\"clock\"; is the statement compiled out?\n",
+                       test.name, static_cast<unsigned long long>(r.p50),
+                       static_cast<unsigned long long>(clock.p50));
+          status = 1;
+        }
+      }
+      if (test.setup)
+        test.setup(false);
+    }
+    if (async)
+      log::shutdown();
+  }
+  return status;
+}
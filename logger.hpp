@@ -0,0 +1,27 @@
+/*
+ * logger.hpp
+ * Copyright (c) 2025 João Pedro Foscarini
+ * SPDX-License-Identifier: MIT
+ *
+ * This file is licensed under the MIT License.
+ * You may obtain a copy of the license at:
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+
+// Includes the C++23 front-end when the standard library has std::format and
+// std::source_location, the C++11 one otherwise. Include either directly to
+// choose it.
+
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+
+#if defined(__cpp_lib_format) && defined(__cpp_lib_source_location)
+#include "logger_cpp23.hpp"
+#else
+#include "logger_cpp11.hpp"
+#endif
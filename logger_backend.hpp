@@ -0,0 +1,3283 @@
+/*
+ * logger_backend.hpp
+ * Copyright (c) 2025 João Pedro Foscarini
+ * SPDX-License-Identifier: MIT
+ *
+ * This file is licensed under the MIT License.
+ * You may obtain a copy of the license at:
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+
+// Definitions behind the LOG_API declarations of logger_core.hpp: the writer
+// thread and its buffers, the sink list, the backtrace, the profiler and the
+// crash handler. Included by logger_core.hpp, or compiled once into the
+// logger library with LOG_COMPILED_LIB.
+
+#include "logger_core.hpp"
+
+#include <condition_variable>
+#include <iomanip>
+#include <iterator>
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+namespace log {
+namespace detail {
+
+// Walks a deferred record, calling visitor.site() once and then one
+// visitor.value()/visitor.string()/visitor.literal()/visitor.call()/
+// visitor.format() per argument. Returns false when the record was truncated by the ring buffer;
+// the complete arguments are still visited.
+template <typename Visitor>
+bool visit_deferred(const char *data, std::size_t size, Visitor &visitor) {
+  const char *in = data;
+  const char *end = data + size;
+  const DeferredSite *site;
+  if (!read_raw(in, end, site))
+    return false;
+  visitor.site(*site);
+  for (char tag; read_raw(in, end, tag);) {
+    if (tag == deferred_signed) {
+      long long value;
+      if (!read_raw(in, end, value))
+        return false;
+      visitor.value(value);
+    } else if (tag == deferred_unsigned) {
+      unsigned long long value;
+      if (!read_raw(in, end, value))
+        return false;
+      visitor.value(value);
+    } else if (tag == deferred_double) {
+      double value;
+      if (!read_raw(in, end, value))
+        return false;
+      visitor.value(value);
+    } else if (tag == deferred_char) {
+      char value;
+      if (!read_raw(in, end, value))
+        return false;
+      visitor.value(value);
+    } else if (tag == deferred_string) {
+      std::uint32_t length;
+      if (!read_raw(in, end, length) ||
+          static_cast<std::size_t>(end - in) < length)
+        return false;
+      visitor.string(in, length);
+      in += length;
+    } else if (tag == deferred_literal) {
+      const char *literal;
+      if (!read_raw(in, end, literal))
+        return false;
+      visitor.literal(literal);
+    } else if (tag == deferred_call) {
+      DeferredCall call;
+      std::uint32_t length;
+      if (!read_raw(in, end, call) || !read_raw(in, end, length) ||
+          static_cast<std::size_t>(end - in) < length)
+        return false;
+      visitor.call(call, in);
+      in += length;
+    } else if (tag == deferred_format) {
+      const DeferredFormatter *formatter =
+          site->formatter.load(std::memory_order_relaxed);
+      if (!formatter || !visitor.format(*formatter, site->format,
+                                        site->format_size, in, end))
+        return false;
+    } else if (tag == deferred_format_inline) {
+      const DeferredFormatter *formatter;
+      std::uint32_t length;
+      if (!read_raw(in, end, formatter) || !read_raw(in, end, length) ||
+          static_cast<std::size_t>(end - in) < length)
+        return false;
+      const char *format = in;
+      in += length;
+      if (!visitor.format(*formatter, format, length, in, end))
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+class DeferredText {
+public:
+  explicit DeferredText(LineBuffer &out) : m_out(out) {}
+
+  // The prefix comes from the record header.
+  void site(const DeferredSite &) {}
+
+  void value(long long value) { append_signed(m_out, value); }
+  void value(unsigned long long value) { append_unsigned(m_out, value); }
+  void value(char value) { m_out.push_back(value); }
+
+  void value(double value) {
+    char *text = m_out.reserve(32);
+    int written = std::snprintf(text, 32, "%g", value);
+    m_out.commit(written > 0 ? std::min<std::size_t>(written, 31) : 0);
+  }
+
+  void string(const char *data, std::size_t size) { m_out.append(data, size); }
+  void literal(const char *text) { m_out.append(text, std::strlen(text)); }
+  void call(DeferredCall call, const char *closure) { call(closure, m_out); }
+
+  bool format(const DeferredFormatter &formatter, const char *format,
+              std::size_t size, const char *&in, const char *end) {
+    return formatter.format(m_out, format, size, in, end);
+  }
+
+private:
+  LineBuffer &m_out;
+};
+
+// Renders the message of a deferred record.
+inline void format_deferred(LineBuffer &out, const char *data,
+                            std::size_t size) {
+  DeferredText text(out);
+  visit_deferred(data, size, text);
+}
+
+// Binary log format, written by the async writer when
+// AsyncOptions::binary_file is set:
+//
+//   file      "LOGB", version byte, entries
+//   entry     binary_site:   varint id, varint level, varint length, category,
+//                            varint length, format string
+//             binary_string: varint id, varint length, bytes
+//             binary_record: varint site id, zigzag varint timestamp delta in
+//                            ns, varint length, arguments
+//   argument  deferred tag, then a zigzag varint ('i'), varint ('u'), 8 raw
+//             bytes ('d'), 1 byte ('c', 'b'), varint length and bytes ('s'),
+//             varint string id ('p') or varint count and that many arguments
+//             for the site's format string ('f')
+//
+// Every call site and string literal is written once, the first time it is
+// used, so records only carry their arguments. Records that were not
+// deferred share a site per level and category without a format string and
+// carry their message and fields as strings. The results of log::deferred()
+// callables, and the text of format() statements whose arguments
+// render_format() does not reproduce, are stored as strings.
+const char binary_magic[4] = {'L', 'O', 'G', 'B'};
+const char binary_version = 2;
+
+enum BinaryEntry : char {
+  binary_site = 1,
+  binary_record = 2,
+  binary_string = 3,
+};
+
+inline void append_varint(LineBuffer &out, std::uint64_t value) {
+  char *bytes = out.reserve(10);
+  std::size_t count = 0;
+  while (value >= 0x80) {
+    bytes[count++] = static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  bytes[count++] = static_cast<char>(value);
+  out.commit(count);
+}
+
+inline std::uint64_t zigzag(std::int64_t value) {
+  return (static_cast<std::uint64_t>(value) << 1) ^
+         static_cast<std::uint64_t>(value >> 63);
+}
+
+inline std::int64_t unzigzag(std::uint64_t value) {
+  return static_cast<std::int64_t>(value >> 1) ^
+         -static_cast<std::int64_t>(value & 1);
+}
+
+// The format spec of a replacement field, see render_format().
+struct FormatSpec {
+  char fill;
+  char align; // 0 when not given
+  char sign;  // 0 when not given
+  bool alternate;
+  bool zero;
+  std::size_t width;
+  int precision; // -1 when not given
+  char type;     // 0 when not given
+
+  FormatSpec()
+      : fill(' '), align(0), sign(0), alternate(false), zero(false),
+        width(0), precision(-1), type(0) {}
+};
+
+inline bool parse_format_number(const char *&in, const char *end,
+                                std::size_t &value) {
+  if (in == end || *in < '0' || *in > '9')
+    return false;
+  for (value = 0; in != end && *in >= '0' && *in <= '9'; ++in) {
+    if (value > 0xffff)
+      return false;
+    value = value * 10 + static_cast<std::size_t>(*in - '0');
+  }
+  return true;
+}
+
+// Reads the spec after the ':' and leaves in at the closing brace.
+inline bool parse_format_spec(const char *&in, const char *end,
+                              FormatSpec &spec) {
+  if (end - in >= 2 && (in[1] == '<' || in[1] == '>' || in[1] == '^')) {
+    if (in[0] == '{' || in[0] == '}' ||
+        static_cast<unsigned char>(in[0]) >= 0x80)
+      return false;
+    spec.fill = in[0];
+    spec.align = in[1];
+    in += 2;
+  } else if (in != end && (*in == '<' || *in == '>' || *in == '^')) {
+    spec.align = *in++;
+  }
+  if (in != end && (*in == '+' || *in == '-' || *in == ' '))
+    spec.sign = *in++;
+  if (in != end && *in == '#') {
+    spec.alternate = true;
+    ++in;
+  }
+  if (in != end && *in == '0') {
+    spec.zero = true;
+    ++in;
+  }
+  if (in != end && *in >= '1' && *in <= '9' &&
+      !parse_format_number(in, end, spec.width))
+    return false;
+  if (in != end && *in == '.') {
+    std::size_t precision;
+    if (!parse_format_number(++in, end, precision))
+      return false;
+    spec.precision = static_cast<int>(precision);
+  }
+  if (in != end && *in != '}')
+    spec.type = *in++;
+  return in != end && *in == '}';
+}
+
+inline void append_fill(LineBuffer &out, char fill, std::size_t count) {
+  for (; count != 0; --count)
+    out.push_back(fill);
+}
+
+// Appends head (sign and base prefix) and body padded to spec.width. Numbers
+// take zero padding between the two.
+inline void append_aligned(LineBuffer &out, const FormatSpec &spec,
+                           char align, bool number, const char *head,
+                           std::size_t head_size, const char *body,
+                           std::size_t body_size) {
+  std::size_t size = head_size + body_size;
+  std::size_t padding = spec.width > size ? spec.width - size : 0;
+  if (number && spec.zero && !spec.align) {
+    out.append(head, head_size);
+    append_fill(out, '0', padding);
+    out.append(body, body_size);
+    return;
+  }
+  if (spec.align)
+    align = spec.align;
+  std::size_t before = align == '>' ? padding : align == '^' ? padding / 2 : 0;
+  append_fill(out, spec.fill, before);
+  out.append(head, head_size);
+  out.append(body, body_size);
+  append_fill(out, spec.fill, padding - before);
+}
+
+inline bool render_integer(LineBuffer &out, const FormatSpec &spec,
+                           bool negative, unsigned long long magnitude) {
+  if (spec.precision >= 0)
+    return false;
+  unsigned base = 10;
+  const char *digits = "0123456789abcdef";
+  const char *prefix = "";
+  switch (spec.type) {
+  case 0:
+  case 'd':
+    break;
+  case 'b':
+  case 'B':
+    base = 2;
+    prefix = spec.type == 'b' ? "0b" : "0B";
+    break;
+  case 'o':
+    base = 8;
+    prefix = magnitude != 0 ? "0" : "";
+    break;
+  case 'x':
+    base = 16;
+    prefix = "0x";
+    break;
+  case 'X':
+    base = 16;
+    prefix = "0X";
+    digits = "0123456789ABCDEF";
+    break;
+  default:
+    return false;
+  }
+  char head[3];
+  std::size_t head_size = 0;
+  if (negative)
+    head[head_size++] = '-';
+  else if (spec.sign == '+' || spec.sign == ' ')
+    head[head_size++] = spec.sign;
+  for (; spec.alternate && *prefix; ++prefix)
+    head[head_size++] = *prefix;
+  char body[64];
+  std::size_t at = sizeof(body);
+  do {
+    body[--at] = digits[magnitude % base];
+    magnitude /= base;
+  } while (magnitude != 0);
+  append_aligned(out, spec, '>', true, head, head_size, body + at,
+                 sizeof(body) - at);
+  return true;
+}
+
+// Widths and precisions count columns, which is only the bytes in ASCII.
+inline bool render_string(LineBuffer &out, const FormatSpec &spec,
+                          const char *data, std::size_t size) {
+  if ((spec.type != 0 && spec.type != 's') || spec.sign || spec.alternate ||
+      spec.zero)
+    return false;
+  if (spec.width != 0 || spec.precision >= 0)
+    for (std::size_t i = 0; i < size; ++i)
+      if (static_cast<unsigned char>(data[i]) >= 0x80)
+        return false;
+  if (spec.precision >= 0 && size > static_cast<std::size_t>(spec.precision))
+    size = static_cast<std::size_t>(spec.precision);
+  append_aligned(out, spec, '<', false, 0, 0, data, size);
+  return true;
+}
+
+// std::to_chars() without a precision: the fewest digits that read back as
+// value, in fixed or scientific notation, whichever is shorter. value must
+// be finite and not negative; text must hold 350 bytes.
+inline std::size_t shortest_double(char *text, double value) {
+  char scientific[32];
+  int written = 0;
+  for (int precision = 0; precision <= 16; ++precision) {
+    written = std::snprintf(scientific, sizeof(scientific), "%.*e", precision,
+                            value);
+    if (std::strtod(scientific, 0) == value)
+      break;
+  }
+  const char *mark = std::strchr(scientific, 'e');
+  int exponent = std::atoi(mark + 1);
+  char digits[17];
+  int count = 0;
+  for (const char *in = scientific; in != mark; ++in)
+    if (*in != '.')
+      digits[count++] = *in;
+
+  // Integers are written exactly rather than padded with zeros.
+  std::size_t size = 0;
+  if (exponent >= count - 1) {
+    size = static_cast<std::size_t>(std::snprintf(text, 350, "%.0f", value));
+  } else if (exponent >= 0) {
+    std::memcpy(text, digits, static_cast<std::size_t>(exponent + 1));
+    size = static_cast<std::size_t>(exponent + 1);
+    text[size++] = '.';
+    std::memcpy(text + size, digits + exponent + 1,
+                static_cast<std::size_t>(count - exponent - 1));
+    size += static_cast<std::size_t>(count - exponent - 1);
+  } else {
+    text[size++] = '0';
+    text[size++] = '.';
+    for (int i = -1; i > exponent; --i)
+      text[size++] = '0';
+    std::memcpy(text + size, digits, static_cast<std::size_t>(count));
+    size += static_cast<std::size_t>(count);
+  }
+  if (size <= static_cast<std::size_t>(written))
+    return size;
+  std::memcpy(text, scientific, static_cast<std::size_t>(written));
+  return static_cast<std::size_t>(written);
+}
+
+inline bool render_double(LineBuffer &out, const FormatSpec &spec,
+                          double value) {
+  char type = spec.type;
+  if ((type != 0 && !std::strchr("fFeEgG", type)) ||
+      (type == 0 && spec.alternate))
+    return false;
+  std::uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  bool negative = (bits >> 63) != 0;
+  char head = negative ? '-' : spec.sign == '-' ? 0 : spec.sign;
+  bool finite = value - value == 0;
+  char body[512];
+  std::size_t size;
+  if (!finite) {
+    if (spec.zero)
+      return false;
+    bool upper = type == 'F' || type == 'E' || type == 'G';
+    std::memcpy(body, value != value ? (upper ? "NAN" : "nan")
+                                     : (upper ? "INF" : "inf"),
+                3);
+    size = 3;
+  } else if (type == 0 && spec.precision < 0) {
+    size = shortest_double(body, negative ? -value : value);
+  } else {
+    char conversion[6] = "%";
+    std::size_t at = 1;
+    if (spec.alternate)
+      conversion[at++] = '#';
+    conversion[at++] = '.';
+    conversion[at++] = '*';
+    conversion[at++] = type ? type : 'g';
+    conversion[at] = 0;
+    int written = std::snprintf(body, sizeof(body), conversion,
+                                spec.precision < 0 ? 6 : spec.precision,
+                                negative ? -value : value);
+    if (written < 0 || static_cast<std::size_t>(written) >= sizeof(body))
+      return false;
+    size = static_cast<std::size_t>(written);
+  }
+  append_aligned(out, spec, '>', finite, &head, head ? 1 : 0, body, size);
+  return true;
+}
+
+inline bool render_value(LineBuffer &out, const FormatSpec &spec,
+                         const DeferredValue &value) {
+  switch (value.type) {
+  case deferred_signed:
+    return render_integer(
+        out, spec, value.signed_integer < 0,
+        value.signed_integer < 0
+            ? 0 - static_cast<unsigned long long>(value.signed_integer)
+            : static_cast<unsigned long long>(value.signed_integer));
+  case deferred_unsigned:
+    return render_integer(out, spec, false, value.unsigned_integer);
+  case deferred_double:
+    return render_double(out, spec, value.number);
+  case deferred_string:
+    return render_string(out, spec, value.data, value.size);
+  case deferred_char: {
+    if (spec.type != 0 && spec.type != 'c')
+      return false;
+    FormatSpec text = spec;
+    text.type = 0;
+    char c = static_cast<char>(value.signed_integer);
+    return text.precision < 0 && render_string(out, text, &c, 1);
+  }
+  case deferred_bool:
+    if (spec.type == 0 || spec.type == 's')
+      return render_string(out, spec, value.signed_integer ? "true" : "false",
+                           value.signed_integer ? 4 : 5);
+    return spec.type != 'c' &&
+           render_integer(out, spec, false, value.signed_integer != 0);
+  default:
+    return false;
+  }
+}
+
+// Reads a format string for the part of std::format()'s syntax the binary
+// log reproduces: automatic or explicit argument ids and a spec with fill
+// and alignment, sign, '#', '0', width, precision and type. Passes the text
+// between fields to visitor.text() and each field to visitor.field(), which
+// may refuse it. Returns false for anything else, such as nested widths or
+// the locale option.
+template <typename Visitor>
+bool scan_format(const char *format, std::size_t size, Visitor &visitor) {
+  const char *in = format;
+  const char *end = format + size;
+  std::size_t next = 0;
+  bool automatic = false;
+  bool manual = false;
+  while (in != end) {
+    const char *text = in;
+    while (in != end && *in != '{' && *in != '}')
+      ++in;
+    visitor.text(text, static_cast<std::size_t>(in - text));
+    if (in == end)
+      break;
+    if (end - in >= 2 && in[1] == in[0]) {
+      visitor.text(in, 1);
+      in += 2;
+      continue;
+    }
+    if (*in++ == '}')
+      return false;
+    std::size_t index;
+    if (in != end && *in >= '0' && *in <= '9') {
+      if (!parse_format_number(in, end, index))
+        return false;
+      manual = true;
+    } else {
+      index = next++;
+      automatic = true;
+    }
+    FormatSpec spec;
+    if (in != end && *in == ':' && !parse_format_spec(++in, end, spec))
+      return false;
+    if (in == end || *in++ != '}' || (automatic && manual) ||
+        !visitor.field(index, spec))
+      return false;
+  }
+  return true;
+}
+
+// Formats values the way std::format() does, see scan_format(). Returns false
+// as well for a type the value does not take.
+inline bool render_format(LineBuffer &out, const char *format,
+                          std::size_t size,
+                          const std::vector<DeferredValue> &values) {
+  struct Renderer {
+    LineBuffer &out;
+    const std::vector<DeferredValue> &values;
+
+    void text(const char *data, std::size_t size) { out.append(data, size); }
+
+    bool field(std::size_t index, const FormatSpec &spec) {
+      return index < values.size() && render_value(out, spec, values[index]);
+    }
+  } renderer = {out, values};
+  return scan_format(format, size, renderer);
+}
+
+// Whether render_value() takes the value with the spec, without rendering
+// it; must refuse whatever render_value() refuses.
+inline bool renderable(const FormatSpec &spec, const DeferredValue &value) {
+  struct Text {
+    static bool ascii(const char *data, std::size_t size) {
+      for (std::size_t i = 0; i < size; ++i)
+        if (static_cast<unsigned char>(data[i]) >= 0x80)
+          return false;
+      return true;
+    }
+
+    static bool takes(const FormatSpec &spec, const char *data,
+                      std::size_t size) {
+      return (spec.type == 0 || spec.type == 's') && !spec.sign &&
+             !spec.alternate && !spec.zero &&
+             ((spec.width == 0 && spec.precision < 0) || ascii(data, size));
+    }
+  };
+  struct Integer {
+    static bool takes(const FormatSpec &spec) {
+      return spec.precision < 0 &&
+             (spec.type == 0 || std::strchr("dbBoxX", spec.type));
+    }
+  };
+  switch (value.type) {
+  case deferred_signed:
+  case deferred_unsigned:
+    return Integer::takes(spec);
+  case deferred_double: {
+    bool finite = value.number - value.number == 0;
+    // Fixed notation of the largest double with a precision over 200 would
+    // not fit render_double()'s buffer.
+    return (spec.type != 0 ? std::strchr("fFeEgG", spec.type) != 0
+                           : !spec.alternate) &&
+           spec.precision <= 200 && (finite || !spec.zero);
+  }
+  case deferred_string:
+    return Text::takes(spec, value.data, value.size);
+  case deferred_char: {
+    if ((spec.type != 0 && spec.type != 'c') || spec.precision >= 0)
+      return false;
+    FormatSpec text = spec;
+    text.type = 0;
+    char c = static_cast<char>(value.signed_integer);
+    return Text::takes(text, &c, 1);
+  }
+  case deferred_bool:
+    if (spec.type == 0 || spec.type == 's')
+      return Text::takes(spec, "false", 5);
+    return spec.type != 'c' && Integer::takes(spec);
+  default:
+    return false;
+  }
+}
+
+// The replacement fields of a format string, parsed once per site by the
+// binary encoder. Empty and not valid when scan_format() refuses the string,
+// so that its records are stored as text.
+struct FormatFields {
+  struct Field {
+    std::size_t index;
+    FormatSpec spec;
+  };
+
+  FormatFields() : valid(false) {}
+
+  void parse(const char *format, std::size_t size) {
+    fields.clear();
+    valid = format && scan_format(format, size, *this);
+    if (!valid)
+      fields.clear();
+  }
+
+  // Whether render_format() reproduces the format with these values.
+  bool take(const std::vector<DeferredValue> &values) const {
+    if (!valid)
+      return false;
+    for (std::size_t i = 0; i < fields.size(); ++i)
+      if (fields[i].index >= values.size() ||
+          !renderable(fields[i].spec, values[fields[i].index]))
+        return false;
+    return true;
+  }
+
+  void text(const char *, std::size_t) {}
+
+  bool field(std::size_t index, const FormatSpec &spec) {
+    Field field = {index, spec};
+    fields.push_back(field);
+    return true;
+  }
+
+  bool valid;
+  std::vector<Field> fields;
+};
+
+class BinaryEncoder {
+public:
+  BinaryEncoder()
+      : m_site_count(0), m_previous(0), m_site(0), m_format(0), m_fields(0),
+        m_out(0) {}
+
+  void header(LineBuffer &out) {
+    out.append(binary_magic, sizeof(binary_magic));
+    out.push_back(binary_version);
+  }
+
+  void record(LineBuffer &out, std::uint64_t timestamp, const char *data,
+              std::size_t size) {
+    m_out = &out;
+    m_arguments.clear();
+    visit_deferred(data, size, *this);
+    append_record(out, timestamp);
+  }
+
+  // A record that was not deferred: its message and the text of its fields
+  // are the arguments of a site for its level and category.
+  void plain(LineBuffer &out, std::uint64_t timestamp, Level level,
+             std::uint16_t category, const char *message, std::size_t size,
+             const char *fields, std::size_t fields_size) {
+    std::uint32_t key = static_cast<std::uint32_t>(level) << 16 | category;
+    std::pair<std::unordered_map<std::uint32_t, std::uint64_t>::iterator, bool>
+        inserted = m_plain_sites.insert(std::make_pair(key, m_site_count));
+    m_site = inserted.first->second;
+    if (inserted.second)
+      describe(out, level, category, 0, 0);
+    m_arguments.clear();
+    string(message, size);
+    if (fields) {
+      m_called.clear();
+      append_text_fields(m_called, fields, fields_size);
+      string(m_called.data(), m_called.size());
+    }
+    append_record(out, timestamp);
+  }
+
+  // visit_deferred() callbacks.
+  void site(const DeferredSite &site) {
+    std::pair<std::unordered_map<const DeferredSite *, Site>::iterator, bool>
+        inserted = m_sites.insert(std::make_pair(&site, Site()));
+    Site &entry = inserted.first->second;
+    if (inserted.second) {
+      entry.id = m_site_count;
+      entry.format.parse(site.format, site.format_size);
+      describe(*m_out, site.level, site.category, site.format,
+               site.format_size);
+    }
+    m_site = entry.id;
+    m_format = site.format;
+    m_fields = &entry.format;
+  }
+
+  void value(long long value) {
+    m_arguments.push_back(deferred_signed);
+    append_varint(m_arguments, zigzag(value));
+  }
+
+  void value(unsigned long long value) {
+    m_arguments.push_back(deferred_unsigned);
+    append_varint(m_arguments, value);
+  }
+
+  void value(double value) {
+    m_arguments.push_back(deferred_double);
+    m_arguments.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  void value(char value) {
+    m_arguments.push_back(deferred_char);
+    m_arguments.push_back(value);
+  }
+
+  void string(const char *data, std::size_t size) {
+    m_arguments.push_back(deferred_string);
+    append_varint(m_arguments, size);
+    m_arguments.append(data, size);
+  }
+
+  void literal(const char *text) {
+    std::pair<std::unordered_map<const char *, std::uint64_t>::iterator, bool>
+        inserted = m_literals.insert(std::make_pair(text, m_literals.size()));
+    if (inserted.second) {
+      std::size_t size = std::strlen(text);
+      m_out->push_back(binary_string);
+      append_varint(*m_out, inserted.first->second);
+      append_varint(*m_out, size);
+      m_out->append(text, size);
+    }
+    m_arguments.push_back(deferred_literal);
+    append_varint(m_arguments, inserted.first->second);
+  }
+
+  void call(DeferredCall call, const char *closure) {
+    m_called.clear();
+    call(closure, m_called);
+    string(m_called.data(), m_called.size());
+  }
+
+  // The arguments of a statement the site describes are kept for the reader
+  // to format, without formatting them here. Only when render_format() would
+  // not reproduce the formatter's text, as the site's parsed format fields
+  // tell, is the text formatted and stored instead.
+  bool format(const DeferredFormatter &formatter, const char *format,
+              std::size_t size, const char *&in, const char *end) {
+    const char *arguments = in;
+    m_values.clear();
+    if (format == m_format && formatter.split(m_values, in, end) &&
+        m_fields->take(m_values)) {
+      m_arguments.push_back(deferred_format);
+      append_varint(m_arguments, m_values.size());
+      for (std::size_t i = 0; i < m_values.size(); ++i)
+        argument(m_values[i]);
+      return true;
+    }
+    in = arguments;
+    m_called.clear();
+    if (!formatter.format(m_called, format, size, in, end))
+      return false;
+    string(m_called.data(), m_called.size());
+    return true;
+  }
+
+private:
+  struct Site {
+    Site() : id(0) {}
+
+    std::uint64_t id;
+    FormatFields format; // of site.format, empty for stream statements
+  };
+
+  std::unordered_map<const DeferredSite *, Site> m_sites;
+  std::unordered_map<std::uint32_t, std::uint64_t> m_plain_sites;
+  std::unordered_map<const char *, std::uint64_t> m_literals;
+  std::uint64_t m_site_count;
+  std::uint64_t m_previous;
+  std::uint64_t m_site;
+  const char *m_format;
+  const FormatFields *m_fields; // of the current site
+  LineBuffer *m_out;
+  LineBuffer m_arguments;
+  LineBuffer m_called;
+  std::vector<DeferredValue> m_values;
+
+  void describe(LineBuffer &out, Level level, std::uint16_t category,
+                const char *format, std::size_t format_size) {
+    const std::string &name = Categories::instance().get(category).name;
+    out.push_back(binary_site);
+    append_varint(out, m_site_count++);
+    append_varint(out, static_cast<std::uint64_t>(level));
+    append_varint(out, name.size());
+    out.append(name.data(), name.size());
+    append_varint(out, format_size);
+    out.append(format, format_size);
+  }
+
+  void append_record(LineBuffer &out, std::uint64_t timestamp) {
+    out.push_back(binary_record);
+    append_varint(out, m_site);
+    append_varint(out, zigzag(static_cast<std::int64_t>(timestamp - m_previous)));
+    append_varint(out, m_arguments.size());
+    out.append(m_arguments.data(), m_arguments.size());
+    m_previous = timestamp;
+  }
+
+  void argument(const DeferredValue &value) {
+    switch (value.type) {
+    case deferred_signed:
+      this->value(value.signed_integer);
+      break;
+    case deferred_unsigned:
+      this->value(value.unsigned_integer);
+      break;
+    case deferred_double:
+      this->value(value.number);
+      break;
+    case deferred_char:
+      this->value(static_cast<char>(value.signed_integer));
+      break;
+    case deferred_bool:
+      m_arguments.push_back(deferred_bool);
+      m_arguments.push_back(value.signed_integer ? 1 : 0);
+      break;
+    default:
+      string(value.data, value.size);
+      break;
+    }
+  }
+};
+
+class BinaryReader {
+public:
+  BinaryReader(const char *data, std::size_t size)
+      : m_in(data), m_end(data + size) {}
+
+  bool done() const { return m_in == m_end; }
+
+  bool byte(char &value) {
+    if (m_in == m_end)
+      return false;
+    value = *m_in++;
+    return true;
+  }
+
+  bool varint(std::uint64_t &value) {
+    value = 0;
+    for (unsigned shift = 0; shift < 64 && m_in != m_end; shift += 7) {
+      unsigned char byte = static_cast<unsigned char>(*m_in++);
+      value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  bool bytes(const char *&data, std::uint64_t size) {
+    if (static_cast<std::uint64_t>(m_end - m_in) < size)
+      return false;
+    data = m_in;
+    m_in += size;
+    return true;
+  }
+
+private:
+  const char *m_in;
+  const char *m_end;
+};
+
+// A binary_site entry, as decode_binary() keeps it.
+struct BinarySite {
+  Level level;
+  std::string category;
+  std::string format;
+};
+
+inline bool decode_value(BinaryReader &in, char tag, DeferredValue &value) {
+  std::uint64_t number;
+  char c;
+  value.type = static_cast<DeferredTag>(tag);
+  if (tag == deferred_signed) {
+    if (!in.varint(number))
+      return false;
+    value.signed_integer = unzigzag(number);
+  } else if (tag == deferred_unsigned) {
+    if (!in.varint(number))
+      return false;
+    value.unsigned_integer = number;
+  } else if (tag == deferred_double) {
+    if (!in.bytes(value.data, sizeof(value.number)))
+      return false;
+    std::memcpy(&value.number, value.data, sizeof(value.number));
+  } else if (tag == deferred_char || tag == deferred_bool) {
+    if (!in.byte(c))
+      return false;
+    value.signed_integer = c;
+  } else if (tag == deferred_string) {
+    if (!in.varint(number) || !in.bytes(value.data, number))
+      return false;
+    value.size = static_cast<std::size_t>(number);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Appends the arguments of a binary_record of site.
+inline bool decode_arguments(BinaryReader &in, LineBuffer &out,
+                             const BinarySite &site,
+                             const std::vector<std::string> &strings,
+                             std::vector<DeferredValue> &values) {
+  DeferredText text(out);
+  for (char tag; in.byte(tag);) {
+    std::uint64_t number;
+    DeferredValue value;
+    if (tag == deferred_literal) {
+      if (!in.varint(number) || number >= strings.size())
+        return false;
+      const std::string &literal = strings[static_cast<std::size_t>(number)];
+      text.string(literal.data(), literal.size());
+    } else if (tag == deferred_format) {
+      if (!in.varint(number))
+        return false;
+      values.clear();
+      for (; number != 0; --number) {
+        if (!in.byte(tag) || !decode_value(in, tag, value))
+          return false;
+        values.push_back(value);
+      }
+      if (!render_format(out, site.format.data(), site.format.size(), values))
+        return false;
+    } else if (!decode_value(in, tag, value)) {
+      return false;
+    } else if (tag == deferred_signed) {
+      text.value(value.signed_integer);
+    } else if (tag == deferred_unsigned) {
+      text.value(value.unsigned_integer);
+    } else if (tag == deferred_double) {
+      text.value(value.number);
+    } else if (tag == deferred_char) {
+      text.value(static_cast<char>(value.signed_integer));
+    } else if (tag == deferred_string) {
+      text.string(value.data, value.size);
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Byte ring with one producer (the owning thread) and one consumer (the
+// writer thread). The producer may also discard the oldest record, so the
+// tail only ever moves by compare-and-swap.
+//
+// A discard frees space the consumer may still be copying out, so the bytes
+// are kept in words accessed with relaxed atomics and validated seqlock
+// style: the producer fences before it writes, the consumer fences after it
+// reads, and its compare-and-swap of the tail then fails if the record was
+// discarded meanwhile.
+class RingBuffer {
+public:
+  explicit RingBuffer(std::size_t capacity)
+      : m_head(0), m_tail(0), m_capacity(round_up(capacity)),
+        m_data(new Word[m_capacity / word]) {}
+
+  std::size_t max_payload() const {
+    return m_capacity - sizeof(RecordHeader) - alignof(RecordHeader);
+  }
+
+  bool empty() const {
+    return m_tail.load(std::memory_order_acquire) ==
+           m_head.load(std::memory_order_acquire);
+  }
+
+  bool try_push(const RecordHeader &header, const char *payload) {
+    std::uint64_t head = m_head.load(std::memory_order_relaxed);
+    std::uint64_t tail = m_tail.load(std::memory_order_acquire);
+    std::uint64_t total = record_size(header.size);
+    if (total > m_capacity - (head - tail))
+      return false;
+    std::atomic_thread_fence(std::memory_order_release);
+    copy_in(head, &header, sizeof(header));
+    copy_in(head + sizeof(header), payload, header.size);
+    m_head.store(head + total, std::memory_order_release);
+    return true;
+  }
+
+  // Returns true with the discarded record's header, or false when the
+  // writer consumed the record first, which frees space too.
+  bool discard_oldest(RecordHeader &header) {
+    std::uint64_t tail = m_tail.load(std::memory_order_acquire);
+    if (tail == m_head.load(std::memory_order_relaxed))
+      return false;
+    copy_out(tail, &header, sizeof(header));
+    return m_tail.compare_exchange_strong(tail, tail + record_size(header.size),
+                                          std::memory_order_acq_rel);
+  }
+
+  // Bytes queued, as seen by the producer.
+  std::size_t used() const {
+    return static_cast<std::size_t>(m_head.load(std::memory_order_relaxed) -
+                                    m_tail.load(std::memory_order_relaxed));
+  }
+
+  bool try_pop(RecordHeader &header, std::string &payload) {
+    for (;;) {
+      std::uint64_t tail = m_tail.load(std::memory_order_acquire);
+      if (tail == m_head.load(std::memory_order_acquire))
+        return false;
+      copy_out(tail, &header, sizeof(header));
+      if (header.size > max_payload())
+        continue; // torn read, the producer discarded this record
+      payload.resize(header.size);
+      copy_out(tail + sizeof(header), &payload[0], header.size);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (m_tail.compare_exchange_strong(tail,
+                                         tail + record_size(header.size),
+                                         std::memory_order_acq_rel))
+        return true;
+    }
+  }
+
+  // Reads the header of the oldest record without consuming it.
+  bool front(RecordHeader &header) const {
+    std::uint64_t tail = m_tail.load(std::memory_order_acquire);
+    if (tail == m_head.load(std::memory_order_acquire))
+      return false;
+    copy_out(tail, &header, sizeof(header));
+    return header.size <= max_payload();
+  }
+
+  // try_pop() into a fixed buffer, keeping the first capacity bytes of the
+  // payload. Used by the crash handler, which cannot allocate.
+  bool try_pop(RecordHeader &header, char *payload, std::size_t capacity) {
+    for (;;) {
+      std::uint64_t tail = m_tail.load(std::memory_order_acquire);
+      if (tail == m_head.load(std::memory_order_acquire))
+        return false;
+      copy_out(tail, &header, sizeof(header));
+      if (header.size > max_payload())
+        continue;
+      std::uint32_t size = header.size;
+      header.size =
+          static_cast<std::uint32_t>(std::min<std::size_t>(size, capacity));
+      copy_out(tail + sizeof(header), payload, header.size);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (m_tail.compare_exchange_strong(tail, tail + record_size(size),
+                                         std::memory_order_acq_rel))
+        return true;
+    }
+  }
+
+private:
+  typedef std::atomic<std::uint64_t> Word;
+  enum : std::size_t { word = sizeof(std::uint64_t) };
+
+  // Records start on a word and the header fills whole words, so a copy
+  // starts on a word and only its last one can be partial.
+  static_assert(sizeof(RecordHeader) % word == 0 &&
+                    alignof(RecordHeader) <= word,
+                "RecordHeader must fill whole ring words");
+
+  static std::size_t round_up(std::size_t capacity) {
+    std::size_t size = 4096;
+    while (size < capacity)
+      size <<= 1;
+    return size;
+  }
+
+  static std::uint64_t record_size(std::uint32_t payload) {
+    return (sizeof(RecordHeader) + payload + word - 1) & ~std::uint64_t(word - 1);
+  }
+
+  // A partial last word is written whole, over the record's padding.
+  void copy_in(std::uint64_t pos, const void *src, std::size_t size) {
+    const char *from = static_cast<const char *>(src);
+    std::size_t index = static_cast<std::size_t>(pos & (m_capacity - 1)) / word;
+    for (std::size_t done = 0; done < size; done += word) {
+      std::uint64_t value = 0;
+      std::memcpy(&value, from + done, std::min<std::size_t>(word, size - done));
+      m_data[index].store(value, std::memory_order_relaxed);
+      index = (index + 1) & (m_capacity / word - 1);
+    }
+  }
+
+  void copy_out(std::uint64_t pos, void *dst, std::size_t size) const {
+    char *to = static_cast<char *>(dst);
+    std::size_t index = static_cast<std::size_t>(pos & (m_capacity - 1)) / word;
+    for (std::size_t done = 0; done < size; done += word) {
+      std::uint64_t value = m_data[index].load(std::memory_order_relaxed);
+      std::memcpy(to + done, &value, std::min<std::size_t>(word, size - done));
+      index = (index + 1) & (m_capacity / word - 1);
+    }
+  }
+
+  // Head and tail live on separate cache lines to avoid false sharing.
+  std::atomic<std::uint64_t> m_head;
+  char m_pad_head[64 - sizeof(std::atomic<std::uint64_t>)];
+  std::atomic<std::uint64_t> m_tail;
+  char m_pad_tail[64 - sizeof(std::atomic<std::uint64_t>)];
+  const std::size_t m_capacity;
+  std::unique_ptr<Word[]> m_data;
+};
+
+struct ThreadBuffer {
+  ThreadBuffer(std::size_t capacity, std::size_t node)
+      : ring(capacity), size(capacity), node(node), serial(0), retired(false) {}
+
+  RingBuffer ring;
+  std::size_t size;   // the thread_buffer_size it was created with
+  std::size_t node;   // NUMA node of the thread's first record
+  std::size_t serial; // registration order
+  std::atomic<bool> retired;
+};
+
+// The machine's NUMA nodes, read once from sysfs. Machines without NUMA
+// support, or without a readable /sys, look like a single node.
+class NumaTopology {
+public:
+  static const NumaTopology &instance() {
+    static NumaTopology topology;
+    return topology;
+  }
+
+  std::size_t nodes() const { return m_nodes; }
+
+  // Node of the CPU the calling thread runs on, from 0 to nodes() - 1.
+  std::size_t current_node() const {
+    int cpu = sched_getcpu();
+    if (cpu < 0 || static_cast<std::size_t>(cpu) >= m_cpu_node.size())
+      return 0;
+    return m_cpu_node[static_cast<std::size_t>(cpu)];
+  }
+
+private:
+  NumaTopology() : m_nodes(0) {
+    std::vector<int> online;
+    read_list("/sys/devices/system/node/online", online);
+    for (std::size_t i = 0; i < online.size(); ++i) {
+      char path[64];
+      std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                    online[i]);
+      std::vector<int> cpus;
+      read_list(path, cpus);
+      if (cpus.empty())
+        continue; // memory-only node
+      for (std::size_t c = 0; c < cpus.size(); ++c) {
+        std::size_t cpu = static_cast<std::size_t>(cpus[c]);
+        if (cpu >= m_cpu_node.size())
+          m_cpu_node.resize(cpu + 1, 0);
+        m_cpu_node[cpu] = m_nodes;
+      }
+      ++m_nodes;
+    }
+    if (m_nodes == 0)
+      m_nodes = 1;
+  }
+
+  // Parses a sysfs list such as "0-3,8-11".
+  static void read_list(const char *path, std::vector<int> &values) {
+    std::FILE *file = std::fopen(path, "r");
+    if (!file)
+      return;
+    int first, last;
+    while (std::fscanf(file, "%d", &first) == 1) {
+      last = first;
+      int separator = std::fgetc(file);
+      if (separator == '-' && std::fscanf(file, "%d", &last) == 1)
+        separator = std::fgetc(file);
+      for (int value = first; value <= last; ++value)
+        values.push_back(value);
+      if (separator != ',')
+        break;
+    }
+    std::fclose(file);
+  }
+
+  std::vector<std::size_t> m_cpu_node;
+  std::size_t m_nodes;
+};
+
+// Registry behind stats(). Every thread counts its records per level and per
+// category in its own table, which only it writes, and the writer threads
+// keep the batch histograms; stats() adds them up. A thread's counts are
+// folded into m_retired when it exits. Leaked on purpose, like Categories.
+class StatsRegistry {
+public:
+  static StatsRegistry &instance() {
+    static StatsRegistry *registry = new StatsRegistry();
+    return *registry;
+  }
+
+  // Counts a record of the calling thread, dropped or not. Logs the
+  // statistics from this thread when the interval given to set_interval()
+  // is up.
+  void count(const RecordHeader &header, std::size_t size, bool kept) {
+    ThreadCounters &counters = local();
+    counters.add(counters.levels[header.level], size, kept);
+    counters.add(counters.category(header.category), size, kept);
+    std::uint64_t due = m_next_dump.load(std::memory_order_relaxed);
+    if (due == 0)
+      return;
+    std::uint64_t now = steady_nanoseconds();
+    if (now >= due &&
+        m_next_dump.compare_exchange_strong(
+            due, now + m_interval.load(std::memory_order_relaxed),
+            std::memory_order_relaxed))
+      dump();
+  }
+
+  // Moves a record the calling thread queued earlier from emitted to dropped.
+  void discarded(const RecordHeader &header) {
+    ThreadCounters &counters = local();
+    counters.discard(counters.levels[header.level], header.size);
+    counters.discard(counters.category(header.category), header.size);
+  }
+
+  // The calling thread's buffer holds `bytes` after a push.
+  void queued(std::size_t bytes) {
+    ThreadCounters &counters = local();
+    if (bytes > counters.high_water.load(std::memory_order_relaxed))
+      counters.high_water.store(bytes, std::memory_order_relaxed);
+  }
+
+  // Writer thread only.
+  void batch(std::size_t records) { m_batch_sizes.add(records); }
+  void pass(std::uint64_t nanoseconds) { m_flush_latency.add(nanoseconds); }
+
+  void set_interval(std::chrono::milliseconds interval) {
+    m_interval.store(to_nanoseconds(interval), std::memory_order_relaxed);
+    m_next_dump.store(interval.count() > 0
+                          ? steady_nanoseconds() + to_nanoseconds(interval)
+                          : 0,
+                      std::memory_order_relaxed);
+  }
+
+  Stats snapshot() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats stats;
+    std::vector<Stats::Counters> categories(m_retired_categories);
+    for (std::size_t i = 0; i < Stats::level_count; ++i)
+      stats.levels[i] = m_retired.levels[i];
+    stats.queue_high_water = m_retired.queue_high_water;
+    for (std::size_t i = 0; i < m_threads.size(); ++i)
+      m_threads[i]->merge(stats, categories);
+    for (std::size_t id = 0; id < categories.size(); ++id)
+      if (categories[id].emitted != 0 || categories[id].dropped != 0)
+        stats.categories.push_back(std::make_pair(
+            Categories::instance().get(static_cast<std::uint16_t>(id)).name,
+            categories[id]));
+    m_batch_sizes.merge(stats.batch_sizes);
+    m_flush_latency.merge(stats.flush_latency);
+    return stats;
+  }
+
+  void dump();
+
+private:
+  enum : std::size_t { chunk_size = 256, chunk_count = 256 };
+
+  // Every counter has a single writer, so a load and a store suffice.
+  static void bump(std::atomic<std::uint64_t> &counter, std::uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+  }
+
+  struct AtomicCounters {
+    AtomicCounters() : emitted(0), dropped(0), bytes(0) {}
+
+    void merge(Stats::Counters &into) const {
+      into.emitted += emitted.load(std::memory_order_relaxed);
+      into.dropped += dropped.load(std::memory_order_relaxed);
+      into.bytes += bytes.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<std::uint64_t> emitted;
+    std::atomic<std::uint64_t> dropped;
+    std::atomic<std::uint64_t> bytes;
+  };
+
+  class ThreadCounters {
+  public:
+    ThreadCounters() : high_water(0) {
+      for (std::size_t i = 0; i < chunk_count; ++i)
+        m_chunks[i].store(0, std::memory_order_relaxed);
+    }
+
+    ~ThreadCounters() {
+      for (std::size_t i = 0; i < chunk_count; ++i)
+        delete[] m_chunks[i].load(std::memory_order_relaxed);
+    }
+
+    AtomicCounters &category(std::uint16_t id) {
+      std::atomic<AtomicCounters *> &slot = m_chunks[id / chunk_size];
+      AtomicCounters *chunk = slot.load(std::memory_order_relaxed);
+      if (!chunk) {
+        chunk = new AtomicCounters[chunk_size];
+        slot.store(chunk, std::memory_order_release);
+      }
+      return chunk[id % chunk_size];
+    }
+
+    static void add(AtomicCounters &counters, std::size_t size, bool kept) {
+      if (kept) {
+        bump(counters.emitted, 1);
+        bump(counters.bytes, size);
+      } else {
+        bump(counters.dropped, 1);
+      }
+    }
+
+    // Adding the two's complement subtracts.
+    static void discard(AtomicCounters &counters, std::size_t size) {
+      bump(counters.emitted, ~0ULL);
+      bump(counters.bytes, 0 - static_cast<std::uint64_t>(size));
+      bump(counters.dropped, 1);
+    }
+
+    void merge(Stats &stats, std::vector<Stats::Counters> &categories) const {
+      for (std::size_t i = 0; i < Stats::level_count; ++i)
+        levels[i].merge(stats.levels[i]);
+      stats.queue_high_water = std::max(
+          stats.queue_high_water, high_water.load(std::memory_order_relaxed));
+      for (std::size_t c = 0; c < chunk_count; ++c) {
+        const AtomicCounters *chunk =
+            m_chunks[c].load(std::memory_order_acquire);
+        if (!chunk)
+          continue;
+        if (categories.size() < (c + 1) * chunk_size)
+          categories.resize((c + 1) * chunk_size);
+        for (std::size_t i = 0; i < chunk_size; ++i)
+          chunk[i].merge(categories[c * chunk_size + i]);
+      }
+    }
+
+    AtomicCounters levels[Stats::level_count];
+    std::atomic<std::size_t> high_water;
+
+  private:
+    std::atomic<AtomicCounters *> m_chunks[chunk_count];
+  };
+
+  // Written by the writer threads, of which there may be several.
+  struct AtomicHistogram {
+    AtomicHistogram() : count(0), total(0), max(0) {
+      for (std::size_t i = 0; i < profile_buckets; ++i)
+        buckets[i].store(0, std::memory_order_relaxed);
+    }
+
+    void add(std::uint64_t value) {
+      count.fetch_add(1, std::memory_order_relaxed);
+      total.fetch_add(value, std::memory_order_relaxed);
+      std::uint64_t seen = max.load(std::memory_order_relaxed);
+      while (value > seen &&
+             !max.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+        ;
+      buckets[profile_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void merge(Stats::Histogram &into) const {
+      into.count = count.load(std::memory_order_relaxed);
+      into.total = total.load(std::memory_order_relaxed);
+      into.max = max.load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < profile_buckets; ++i)
+        into.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+    }
+
+    std::atomic<std::uint64_t> count;
+    std::atomic<std::uint64_t> total;
+    std::atomic<std::uint64_t> max;
+    std::atomic<std::uint64_t> buckets[profile_buckets];
+  };
+
+  struct LocalHandle {
+    std::shared_ptr<ThreadCounters> counters;
+
+    ~LocalHandle() {
+      if (counters)
+        StatsRegistry::instance().retire(counters);
+    }
+  };
+
+  StatsRegistry() : m_interval(0), m_next_dump(0) {}
+
+  ThreadCounters &local() {
+    LocalHandle &handle = thread_instance<LocalHandle>();
+    if (!handle.counters) {
+      handle.counters = std::make_shared<ThreadCounters>();
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_threads.push_back(handle.counters);
+    }
+    return *handle.counters;
+  }
+
+  void retire(const std::shared_ptr<ThreadCounters> &counters) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    counters->merge(m_retired, m_retired_categories);
+    m_threads.erase(std::find(m_threads.begin(), m_threads.end(), counters));
+  }
+
+  std::mutex m_mutex;
+  std::vector<std::shared_ptr<ThreadCounters> > m_threads;
+  Stats m_retired; // levels and high water of exited threads
+  std::vector<Stats::Counters> m_retired_categories; // by category id
+  AtomicHistogram m_batch_sizes;
+  AtomicHistogram m_flush_latency;
+  std::atomic<std::uint64_t> m_interval;
+  std::atomic<std::uint64_t> m_next_dump; // zero: no periodic dump
+};
+
+
+// The installed sinks, a console sink by default. Leaked on purpose so the
+// writer's final drain during static destruction still has somewhere to go.
+class SinkList {
+public:
+  static SinkList &instance() {
+    static SinkList *sinks = new SinkList();
+    return *sinks;
+  }
+
+  std::mutex &mutex() { return m_mutex; }
+
+  void add(const std::shared_ptr<Sink> &sink) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_sinks.push_back(sink);
+    update_level();
+  }
+
+  void remove(const std::shared_ptr<Sink> &sink) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::shared_ptr<Sink> >::iterator it =
+        std::find(m_sinks.begin(), m_sinks.end(), sink);
+    if (it == m_sinks.end())
+      return;
+    sink->flush();
+    m_sinks.erase(it);
+    update_level();
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (std::size_t i = 0; i < m_sinks.size(); ++i)
+      m_sinks[i]->flush();
+    m_sinks.clear();
+    update_level();
+  }
+
+  // Whether some sink may accept the level, without the lock. A sink that
+  // lowers its level lowers this at once; one that raises it only counts
+  // when the list changes, so the answer errs on the side of yes.
+  bool accepts(Level level) const {
+    return severity(level) >= m_level.load(std::memory_order_relaxed);
+  }
+
+  void lower_level(int level) {
+    int current = m_level.load(std::memory_order_relaxed);
+    while (level < current &&
+           !m_level.compare_exchange_weak(current, level,
+                                          std::memory_order_relaxed)) {
+    }
+  }
+
+  // write() and flush() expect mutex() to be held.
+  void write(const Record &record) {
+    for (std::size_t i = 0; i < m_sinks.size(); ++i)
+      if (m_sinks[i]->accepts(record.level))
+        m_sinks[i]->write(record);
+  }
+
+  void flush() {
+    for (std::size_t i = 0; i < m_sinks.size(); ++i)
+      m_sinks[i]->flush();
+  }
+
+  void end_batch() {
+    for (std::size_t i = 0; i < m_sinks.size(); ++i)
+      m_sinks[i]->end_batch();
+  }
+
+private:
+  SinkList() : m_level(severity(Level::Trace)) {
+    m_sinks.push_back(std::make_shared<ConsoleSink>());
+  }
+
+  // Expects mutex() to be held.
+  void update_level() {
+    int level = INT_MAX;
+    for (int i = 0; i <= severity(Level::Emergency) && level == INT_MAX; ++i)
+      for (std::size_t s = 0; s < m_sinks.size(); ++s)
+        if (m_sinks[s]->accepts(static_cast<Level>(i)))
+          level = i;
+    m_level.store(level, std::memory_order_relaxed);
+  }
+
+  std::mutex m_mutex;
+  std::vector<std::shared_ptr<Sink> > m_sinks;
+  std::atomic<int> m_level; // the lowest level a sink accepts
+};
+
+} // namespace detail
+
+LOG_API void Sink::set_level(Level level) {
+  m_level.store(detail::severity(level), std::memory_order_relaxed);
+  detail::SinkList::instance().lower_level(detail::severity(level));
+}
+
+namespace detail {
+
+// Turns a queued record into a Record for the sinks, rendering deferred
+// arguments into scratch. timestamp is already on the system clock.
+inline Record make_record(const RecordHeader &header, std::uint64_t timestamp,
+                          const char *data, std::size_t size,
+                          LineBuffer &scratch) {
+  Record record;
+  record.level = static_cast<Level>(header.level);
+  record.category = header.category;
+  record.timestamp = timestamp;
+  record.fields = 0;
+  record.fields_size = 0;
+  if (header.flags & record_fields)
+    split_fields(data, size, record.fields, record.fields_size);
+  record.message = data;
+  record.size = size;
+  if (header.flags & record_deferred) {
+    scratch.clear();
+    format_deferred(scratch, data, size);
+    record.message = scratch.data();
+    record.size = scratch.size();
+  }
+  return record;
+}
+
+// Writes a record on the calling thread.
+inline void write_now(const RecordHeader &header, const char *data,
+                      std::size_t size) {
+  std::uint64_t timestamp = header.timestamp;
+  if (header.flags & record_steady_clock)
+    timestamp += system_nanoseconds() - steady_nanoseconds();
+  SinkList &sinks = SinkList::instance();
+  if (!sinks.accepts(static_cast<Level>(header.level)))
+    return;
+  LineBuffer scratch;
+  Record record = make_record(header, timestamp, data, size, scratch);
+  std::lock_guard<std::mutex> lock(sinks.mutex());
+  sinks.write(record);
+  sinks.flush();
+}
+
+// Collapses runs of identical records on the writer thread, see
+// AsyncOptions::dedup_window. Records are the same when they come from the
+// same call site with the same level, category, message and fields; the
+// bytes of the run's first record are kept to compare them. Expects the sink
+// list's mutex to be held.
+class Deduplicator {
+public:
+  Deduplicator()
+      : m_window(0), m_active(false), m_first(0), m_last(0), m_repeats(0),
+        m_level(Level::Info), m_category(0), m_site(0), m_message_size(0) {}
+
+  void set_window(std::chrono::milliseconds window) {
+    m_window = static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(window).count());
+  }
+
+  // Returns false for a repeat, which the caller leaves out. Ends the current
+  // run first when the record does not belong to it.
+  bool admit(const Record &record, const CallSite *site, SinkList &sinks) {
+    if (m_window == 0)
+      return true;
+    if (repeats(record, site) && record.timestamp < m_first + m_window) {
+      ++m_repeats;
+      m_last = std::max(m_last, record.timestamp);
+      return false;
+    }
+    summarize(sinks);
+    m_active = true;
+    m_first = m_last = record.timestamp;
+    m_level = record.level;
+    m_category = record.category;
+    m_site = site;
+    m_record.clear();
+    m_record.append(record.message, record.size);
+    if (record.fields_size != 0)
+      m_record.append(record.fields, record.fields_size);
+    m_message_size = record.size;
+    return true;
+  }
+
+  // Ends the current run once its window has passed by `now`, or at once
+  // when `force` is set.
+  void expire(SinkList &sinks, std::uint64_t now, bool force) {
+    if (m_repeats != 0 && (force || now >= m_first + m_window))
+      summarize(sinks);
+    if (force)
+      m_active = false;
+  }
+
+private:
+  bool repeats(const Record &record, const CallSite *site) const {
+    return m_active && site == m_site && record.level == m_level &&
+           record.category == m_category && record.size == m_message_size &&
+           record.size + record.fields_size == m_record.size() &&
+           std::memcmp(m_record.data(), record.message, record.size) == 0 &&
+           (record.fields_size == 0 ||
+            std::memcmp(m_record.data() + record.size, record.fields,
+                        record.fields_size) == 0);
+  }
+
+  void summarize(SinkList &sinks) {
+    if (m_repeats == 0)
+      return;
+    m_line.clear();
+    m_line.append("last message repeated ");
+    append_unsigned(m_line, m_repeats);
+    m_line.append(" times");
+    Record record;
+    record.level = m_level;
+    record.category = m_category;
+    record.timestamp = m_last;
+    record.message = m_line.data();
+    record.size = m_line.size();
+    record.fields = 0;
+    record.fields_size = 0;
+    sinks.write(record);
+    m_repeats = 0;
+  }
+
+  std::uint64_t m_window; // nanoseconds, zero: off
+  bool m_active;          // whether a run is open
+  std::uint64_t m_first;  // timestamp of the record that was written
+  std::uint64_t m_last;   // timestamp of the latest repeat
+  unsigned long long m_repeats;
+  Level m_level;
+  std::uint16_t m_category;
+  const CallSite *m_site;
+  LineBuffer m_record; // the run's message, then its fields
+  std::size_t m_message_size;
+  LineBuffer m_line;
+};
+
+// An alternate signal stack for the calling thread, so that the crash handler
+// still runs when a SIGSEGV comes from a stack overflow. Signal stacks are per
+// thread: install_crash_handler() sets one up for its caller, and each
+// producer thread gets one with its ring buffer once the handler is in place.
+// A stack the program set up itself is left alone.
+struct SignalStack {
+  SignalStack() : data(0) {}
+
+  ~SignalStack() {
+    if (!data)
+      return;
+    stack_t disabled;
+    std::memset(&disabled, 0, sizeof(disabled));
+    disabled.ss_flags = SS_DISABLE;
+    ::sigaltstack(&disabled, 0);
+    std::free(data);
+  }
+
+  SignalStack(const SignalStack &) = delete;
+  SignalStack &operator=(const SignalStack &) = delete;
+
+  // Set while a crash handler is installed.
+  static std::atomic<bool> &wanted() {
+    static std::atomic<bool> wanted(false);
+    return wanted;
+  }
+
+  void install() {
+    stack_t current;
+    if (data || (::sigaltstack(0, &current) == 0 &&
+                 !(current.ss_flags & SS_DISABLE)))
+      return;
+    // SIGSTKSZ is not a constant in newer C libraries.
+    std::size_t size = 4 * static_cast<std::size_t>(SIGSTKSZ);
+    data = std::malloc(size);
+    if (!data)
+      return;
+    stack_t stack;
+    std::memset(&stack, 0, sizeof(stack));
+    stack.ss_sp = data;
+    stack.ss_size = size;
+    if (::sigaltstack(&stack, 0) != 0) {
+      std::free(data);
+      data = 0;
+    }
+  }
+
+  void *data;
+};
+
+// Background writer: every producer thread owns a ring buffer, registered on
+// its first record, which a writer thread drains round-robin, merges by
+// timestamp and hands to the sinks in batches. With several writers, each
+// drains the buffers of the threads on its NUMA nodes, and the sink mutex
+// serializes their batches. Leaked on purpose so statements in static
+// destructors still work; the first start() registers an atexit() handler
+// that drains the buffers instead.
+class AsyncWriter {
+public:
+  static AsyncWriter &instance() {
+    static AsyncWriter *writer = new AsyncWriter();
+    return *writer;
+  }
+
+  bool running() const { return m_running.load(std::memory_order_acquire); }
+
+  // Whether records go to AsyncOptions::binary_file rather than the sinks.
+  bool binary() const {
+    return running() && m_binary.load(std::memory_order_relaxed);
+  }
+
+  void start(const AsyncOptions &options) {
+    std::lock_guard<std::mutex> control(m_control);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_running.load(std::memory_order_relaxed))
+      return;
+    if (!m_exit_handler)
+      m_exit_handler = std::atexit(&AsyncWriter::exit_handler) == 0;
+    m_options = options;
+    if (m_options.batch_size == 0)
+      m_options.batch_size = 1;
+    if (!m_options.binary_file.empty())
+      m_options.writers = 1;
+    else if (m_options.writers == 0)
+      m_options.writers = NumaTopology::instance().nodes();
+    m_binary.store(!m_options.binary_file.empty(), std::memory_order_relaxed);
+    m_overflow.store(m_options.overflow, std::memory_order_relaxed);
+    m_buffer_size.store(m_options.thread_buffer_size, std::memory_order_relaxed);
+    m_stopping.store(false, std::memory_order_relaxed);
+    m_writers.clear();
+    for (std::size_t i = 0; i < m_options.writers; ++i) {
+      m_writers.push_back(std::unique_ptr<Writer>(new Writer(i)));
+      m_writers[i]->dedup.set_window(m_options.dedup_window);
+    }
+    for (std::size_t i = 0; i < m_writers.size(); ++i)
+      m_writers[i]->thread =
+          std::thread(&AsyncWriter::run, this, std::ref(*m_writers[i]));
+    m_running.store(true, std::memory_order_release);
+    steady_stamps().store(m_options.clock == ClockSource::Steady,
+                          std::memory_order_release);
+  }
+
+  // Returns false when the record was discarded.
+  bool push(RecordHeader header, const char *data, std::size_t size) {
+    RingBuffer &ring = local_buffer().ring;
+    if (size > ring.max_payload() && (header.flags & record_fields)) {
+      // Truncating would cut off the field section's size; keep the message.
+      const char *fields;
+      std::size_t fields_size;
+      split_fields(data, size, fields, fields_size);
+      header.flags = static_cast<std::uint8_t>(header.flags & ~record_fields);
+    }
+    header.size = static_cast<std::uint32_t>(std::min(size, ring.max_payload()));
+    while (!ring.try_push(header, data)) {
+      switch (m_overflow.load(std::memory_order_relaxed)) {
+      case OverflowPolicy::Block:
+        if (!running()) {
+          write_now(header, data, size);
+          return true;
+        }
+        // The flag ends a Sleep wait early; notifying alone would not.
+        m_space_wanted.store(true, std::memory_order_release);
+        m_wakeup.notify_all();
+        std::this_thread::yield();
+        break;
+      case OverflowPolicy::DropNewest:
+        return false;
+      case OverflowPolicy::DropOldest: {
+        RecordHeader oldest;
+        if (ring.discard_oldest(oldest))
+          StatsRegistry::instance().discarded(oldest);
+        break;
+      }
+      }
+    }
+    StatsRegistry::instance().queued(ring.used());
+    return true;
+  }
+
+  void flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    std::uint64_t ticket = ++m_flush_requested;
+    m_wakeup.notify_all();
+    m_drained.wait(lock, [this, ticket] {
+      return flushed(ticket) || !m_running.load(std::memory_order_relaxed);
+    });
+  }
+
+  // The registered buffer in a slot, or null. Read without locks by the
+  // crash handler; buffers past the first max_buffers are not listed.
+  enum : std::size_t { max_buffers = 256 };
+
+  ThreadBuffer *buffer(std::size_t slot) const {
+    return m_slots[slot].load(std::memory_order_acquire);
+  }
+
+  void stop() {
+    std::lock_guard<std::mutex> control(m_control);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_running.load(std::memory_order_relaxed))
+        return;
+      steady_stamps().store(false, std::memory_order_relaxed);
+      m_running.store(false, std::memory_order_release);
+      m_stopping.store(true, std::memory_order_release);
+    }
+    m_wakeup.notify_all();
+    for (std::size_t i = 0; i < m_writers.size(); ++i)
+      m_writers[i]->thread.join();
+    m_drained.notify_all();
+  }
+
+private:
+  struct Pending {
+    RecordHeader header;
+    std::string text;
+  };
+
+  // A writer thread and the state only it touches; flush_done is guarded by
+  // m_mutex.
+  struct Writer {
+    explicit Writer(std::size_t index)
+        : index(index), flush_done(0), steady_offset(0) {}
+
+    std::size_t index;
+    std::thread thread;
+    std::uint64_t flush_done;
+    std::uint64_t steady_offset;
+    TimestampCache timestamps;
+    LineBuffer scratch;
+    LineBuffer line;
+    Deduplicator dedup;
+  };
+
+  struct LocalHandle {
+    std::shared_ptr<ThreadBuffer> buffer;
+
+    ~LocalHandle() {
+      if (buffer)
+        buffer->retired.store(true, std::memory_order_release);
+    }
+  };
+
+  AsyncWriter()
+      : m_running(false), m_stopping(false), m_binary(false),
+        m_space_wanted(false), m_overflow(OverflowPolicy::Block), m_buffer_size(0),
+        m_exit_handler(false), m_flush_requested(0), m_serial(0) {
+    for (std::size_t i = 0; i < max_buffers; ++i)
+      m_slots[i].store(0, std::memory_order_relaxed);
+  }
+
+  static void exit_handler() { instance().stop(); }
+
+  // A buffer of another thread_buffer_size, left from an earlier
+  // start_async(), is replaced once the writer has emptied it.
+  ThreadBuffer &local_buffer() {
+    LocalHandle &handle = thread_instance<LocalHandle>();
+    std::size_t size = m_buffer_size.load(std::memory_order_relaxed);
+    if (handle.buffer && handle.buffer->size != size &&
+        handle.buffer->ring.empty()) {
+      handle.buffer->retired.store(true, std::memory_order_release);
+      handle.buffer.reset();
+    }
+    if (!handle.buffer) {
+      handle.buffer = std::make_shared<ThreadBuffer>(
+          size, NumaTopology::instance().current_node());
+      if (SignalStack::wanted().load(std::memory_order_acquire))
+        thread_instance<SignalStack>().install();
+      std::lock_guard<std::mutex> lock(m_registry_mutex);
+      handle.buffer->serial = m_serial++;
+      m_registry.push_back(handle.buffer);
+      for (std::size_t i = 0; i < max_buffers; ++i) {
+        if (m_slots[i].load(std::memory_order_relaxed) == 0) {
+          m_slots[i].store(handle.buffer.get(), std::memory_order_release);
+          break;
+        }
+      }
+    }
+    return *handle.buffer;
+  }
+
+  // Expects m_mutex to be held.
+  bool flushed(std::uint64_t ticket) const {
+    for (std::size_t i = 0; i < m_writers.size(); ++i)
+      if (m_writers[i]->flush_done < ticket)
+        return false;
+    return true;
+  }
+
+  // Writer i serves node i % nodes. A node's buffers are dealt round-robin
+  // to its writers, and nodes past the last writer wrap around.
+  std::size_t owner(const ThreadBuffer &buffer) const {
+    std::size_t writers = m_options.writers;
+    std::size_t nodes = NumaTopology::instance().nodes();
+    if (buffer.node >= writers)
+      return buffer.node % writers;
+    std::size_t shared = (writers - buffer.node + nodes - 1) / nodes;
+    return buffer.node + buffer.serial % shared * nodes;
+  }
+
+  // The live buffers owned by a writer.
+  void snapshot(const Writer &writer,
+                std::vector<std::shared_ptr<ThreadBuffer> > &buffers) {
+    std::lock_guard<std::mutex> lock(m_registry_mutex);
+    buffers.clear();
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < m_registry.size(); ++i) {
+      ThreadBuffer &buffer = *m_registry[i];
+      if (buffer.retired.load(std::memory_order_acquire) && buffer.ring.empty()) {
+        for (std::size_t slot = 0; slot < max_buffers; ++slot)
+          if (m_slots[slot].load(std::memory_order_relaxed) == &buffer)
+            m_slots[slot].store(0, std::memory_order_release);
+        continue;
+      }
+      if (owner(buffer) == writer.index)
+        buffers.push_back(m_registry[i]);
+      m_registry[kept++] = m_registry[i];
+    }
+    m_registry.resize(kept);
+  }
+
+  static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+      if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+        return;
+    }
+    std::clog << "log: cannot pin writer thread to CPU " << cpu << '\n';
+  }
+
+  void run(Writer &writer) {
+    if (!m_options.writer_cpus.empty())
+      pin(m_options.writer_cpus[writer.index % m_options.writer_cpus.size()]);
+    std::vector<std::shared_ptr<ThreadBuffer> > buffers;
+    std::vector<Pending> batch(m_options.batch_size);
+    std::vector<Pending *> order;
+    LineBuffer out;
+    BinaryEncoder encoder;
+    std::FILE *binary = 0;
+    if (!m_options.binary_file.empty()) {
+      binary = std::fopen(m_options.binary_file.c_str(), "wb");
+      if (binary) {
+        encoder.header(out);
+        std::fwrite(out.data(), 1, out.size(), binary);
+      } else {
+        std::clog << "log: cannot open " << m_options.binary_file
+                  << ", writing text to std::clog\n";
+      }
+    }
+    for (;;) {
+      std::uint64_t ticket;
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ticket = m_flush_requested;
+      }
+      m_space_wanted.store(false, std::memory_order_relaxed);
+      bool stopping = m_stopping.load(std::memory_order_acquire);
+      snapshot(writer, buffers);
+      writer.steady_offset = system_nanoseconds() - steady_nanoseconds();
+
+      std::uint64_t started = steady_nanoseconds();
+      bool wrote = false;
+      std::size_t count = 0;
+      for (bool progress = true; progress;) {
+        progress = false;
+        for (std::size_t i = 0; i < buffers.size(); ++i) {
+          RingBuffer &ring = buffers[i]->ring;
+          if (ring.try_pop(batch[count].header, batch[count].text)) {
+            progress = true;
+            if (++count == batch.size()) {
+              write(writer, batch, count, order, out, binary ? &encoder : 0,
+                    binary);
+              count = 0;
+              wrote = true;
+            }
+          }
+        }
+      }
+      wrote = wrote || count != 0;
+      write(writer, batch, count, order, out, binary ? &encoder : 0, binary);
+      if (!binary)
+        end_batch(writer, stopping);
+      if (wrote)
+        StatsRegistry::instance().pass(steady_nanoseconds() - started);
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (writer.flush_done < ticket) {
+        writer.flush_done = ticket;
+        m_drained.notify_all();
+      }
+      if (stopping)
+        break;
+      idle(lock, ticket, wrote);
+    }
+    if (binary)
+      std::fclose(binary);
+  }
+
+  // Waits between passes, with m_mutex held on entry. Sleep also waits after
+  // a pass that wrote, so records collect into batches; Yield and Spin only
+  // hold back after an empty pass, and leave flush_interval unused.
+  void idle(std::unique_lock<std::mutex> &lock, std::uint64_t ticket,
+            bool wrote) {
+    switch (m_options.idle) {
+    case IdleStrategy::Sleep:
+      m_wakeup.wait_for(lock, m_options.flush_interval, [this, ticket] {
+        return m_stopping.load(std::memory_order_relaxed) ||
+               m_flush_requested != ticket ||
+               m_space_wanted.load(std::memory_order_acquire);
+      });
+      break;
+    case IdleStrategy::Yield:
+      lock.unlock();
+      if (!wrote)
+        std::this_thread::yield();
+      break;
+    case IdleStrategy::Spin:
+      break;
+    }
+  }
+
+  // The last pass before stopping flushes whatever the sinks still hold.
+  void end_batch(Writer &writer, bool stopping) {
+    SinkList &sinks = SinkList::instance();
+    std::lock_guard<std::mutex> lock(sinks.mutex());
+    writer.dedup.expire(sinks, system_nanoseconds(), stopping);
+    if (stopping)
+      sinks.flush();
+    else
+      sinks.end_batch();
+  }
+
+  static bool earlier(const Pending *lhs, const Pending *rhs) {
+    return lhs->header.timestamp < rhs->header.timestamp;
+  }
+
+  void write(Writer &writer, std::vector<Pending> &batch, std::size_t count,
+             std::vector<Pending *> &order, LineBuffer &out,
+             BinaryEncoder *encoder, std::FILE *binary) {
+    if (count == 0)
+      return;
+    StatsRegistry::instance().batch(count);
+    order.clear();
+    for (std::size_t i = 0; i < count; ++i)
+      order.push_back(&batch[i]);
+    std::stable_sort(order.begin(), order.end(), earlier);
+
+    if (!encoder) {
+      SinkList &sinks = SinkList::instance();
+      std::lock_guard<std::mutex> lock(sinks.mutex());
+      for (std::size_t i = 0; i < count; ++i) {
+        const Pending &pending = *order[i];
+        if (!sinks.accepts(static_cast<Level>(pending.header.level)))
+          continue; // not formatted, so log::deferred() calls do not run
+        Record record =
+            make_record(pending.header, system_timestamp(writer, pending),
+                        pending.text.data(), pending.text.size(),
+                        writer.scratch);
+        if (writer.dedup.admit(record, pending.header.site, sinks))
+          sinks.write(record);
+      }
+      return;
+    }
+
+    out.clear();
+    for (std::size_t i = 0; i < count; ++i) {
+      const Pending &pending = *order[i];
+      std::uint64_t timestamp = system_timestamp(writer, pending);
+      if (pending.header.flags & record_deferred) {
+        const char *payload = pending.text.data();
+        std::size_t size = pending.text.size();
+        if (pending.header.flags & record_fields) {
+          const char *fields;
+          std::size_t fields_size;
+          split_fields(payload, size, fields, fields_size);
+          writer.scratch.clear();
+          writer.scratch.append(payload, size);
+          append_deferred_fields(writer.scratch, fields, fields_size);
+          payload = writer.scratch.data();
+          size = writer.scratch.size();
+        }
+        encoder->record(out, timestamp, payload, size);
+        continue;
+      }
+      const char *message = pending.text.data();
+      std::size_t size = pending.text.size();
+      const char *fields = 0;
+      std::size_t fields_size = 0;
+      if (pending.header.flags & record_fields)
+        split_fields(message, size, fields, fields_size);
+      encoder->plain(out, timestamp, static_cast<Level>(pending.header.level),
+                     pending.header.category, message, size, fields,
+                     fields_size);
+    }
+    std::fwrite(out.data(), 1, out.size(), binary);
+    std::fflush(binary);
+  }
+
+  static std::uint64_t system_timestamp(const Writer &writer,
+                                        const Pending &pending) {
+    std::uint64_t timestamp = pending.header.timestamp;
+    if (pending.header.flags & record_steady_clock)
+      timestamp += writer.steady_offset;
+    return timestamp;
+  }
+
+  std::mutex m_control; // serializes start() and stop()
+  std::mutex m_mutex;
+  std::condition_variable m_wakeup;
+  std::condition_variable m_drained;
+  std::mutex m_registry_mutex;
+  std::vector<std::shared_ptr<ThreadBuffer> > m_registry;
+  // m_registry for the crash handler, written under m_registry_mutex.
+  std::atomic<ThreadBuffer *> m_slots[max_buffers];
+  AsyncOptions m_options; // for the writers, rewritten only once they joined
+  std::vector<std::unique_ptr<Writer> > m_writers;
+  std::atomic<bool> m_running;
+  std::atomic<bool> m_stopping;
+  std::atomic<bool> m_binary;
+  // Set by a blocked producer whose buffer is full, cleared by each pass.
+  std::atomic<bool> m_space_wanted;
+  // The options producers read, published by start().
+  std::atomic<OverflowPolicy> m_overflow;
+  std::atomic<std::size_t> m_buffer_size;
+  bool m_exit_handler; // under m_mutex
+  std::uint64_t m_flush_requested;
+  std::size_t m_serial; // under m_registry_mutex
+};
+
+// Fixed-size line for the crash handler, which must not allocate. Text past
+// the end is dropped, but the line always ends in a newline.
+class CrashLine {
+public:
+  CrashLine() : m_size(0) {}
+
+  const char *data() const { return m_data; }
+  std::size_t size() const { return m_size; }
+  void clear() { m_size = 0; }
+
+  void append(const char *data, std::size_t size) {
+    size = std::min(size, sizeof(m_data) - 1 - m_size);
+    std::memcpy(m_data + m_size, data, size);
+    m_size += size;
+  }
+
+  void append(const char *text) { append(text, std::strlen(text)); }
+  void push_back(char c) { append(&c, 1); }
+
+  void number(unsigned long long value, std::size_t width = 1) {
+    char digits[24];
+    std::size_t count = 0;
+    do {
+      digits[sizeof(digits) - ++count] = static_cast<char>('0' + value % 10);
+      value /= 10;
+    } while (value != 0 || count < width);
+    append(digits + sizeof(digits) - count, count);
+  }
+
+  void end_line() { m_data[m_size++] = '\n'; }
+
+private:
+  char m_data[4096];
+  std::size_t m_size;
+};
+
+// DeferredText for the crash handler. snprintf() is not async-signal-safe,
+// so doubles are printed by hand with up to six decimals, in scientific
+// notation outside [1e-4, 1e6).
+class CrashText {
+public:
+  explicit CrashText(CrashLine &out) : m_out(out) {}
+
+  void site(const DeferredSite &) {}
+
+  void value(long long value) {
+    if (value < 0)
+      m_out.push_back('-');
+    m_out.number(value < 0 ? 0ULL - static_cast<unsigned long long>(value)
+                           : static_cast<unsigned long long>(value));
+  }
+
+  void value(unsigned long long value) { m_out.number(value); }
+  void value(char value) { m_out.push_back(value); }
+
+  void value(double value) {
+    if (value != value) {
+      m_out.append("nan");
+      return;
+    }
+    if (value < 0) {
+      m_out.push_back('-');
+      value = -value;
+    }
+    if (value - value != 0) {
+      m_out.append("inf");
+      return;
+    }
+    int exponent = 0;
+    if (value != 0 && (value >= 1e6 || value < 1e-4)) {
+      for (; value >= 10; value /= 10)
+        ++exponent;
+      for (; value < 1; value *= 10)
+        --exponent;
+    }
+    unsigned long long whole = static_cast<unsigned long long>(value);
+    unsigned long long fraction = static_cast<unsigned long long>(
+        (value - static_cast<double>(whole)) * 1000000 + 0.5);
+    if (fraction == 1000000) {
+      ++whole;
+      fraction = 0;
+    }
+    m_out.number(whole);
+    if (fraction != 0) {
+      std::size_t places = 6;
+      for (; fraction % 10 == 0; fraction /= 10)
+        --places;
+      m_out.push_back('.');
+      m_out.number(fraction, places);
+    }
+    if (exponent != 0) {
+      m_out.push_back('e');
+      m_out.push_back(exponent < 0 ? '-' : '+');
+      m_out.number(
+          static_cast<unsigned long long>(exponent < 0 ? -exponent : exponent), 2);
+    }
+  }
+
+  void string(const char *data, std::size_t size) { m_out.append(data, size); }
+  void literal(const char *text) { m_out.append(text); }
+
+  // Running user code is not async-signal-safe.
+  void call(DeferredCall, const char *) { m_out.append("<deferred>"); }
+
+  // Nor is formatting; the format string stands in for the text and the
+  // arguments, whose size only the formatter knows, end the record.
+  bool format(const DeferredFormatter &, const char *format, std::size_t size,
+              const char *&, const char *) {
+    m_out.append(format, size);
+    return false;
+  }
+
+private:
+  CrashLine &m_out;
+};
+
+// Writes the records still queued in the thread buffers to a file descriptor
+// when the process receives a fatal signal, then lets the signal take its
+// previous course. Everything the handler reaches is async-signal-safe: it
+// takes no locks, does not allocate and only calls write(2), clock_gettime(2),
+// sigaction(2) and raise(3). Leaked on purpose so a crash during static
+// destruction is still covered.
+class CrashHandler {
+public:
+  static CrashHandler &instance() {
+    static CrashHandler *handler = new CrashHandler();
+    return *handler;
+  }
+
+  void install(int fd) {
+    AsyncWriter::instance(); // constructed here, not in the handler
+    m_fd = fd;
+    m_colored = ::isatty(fd) == 1;
+    // localtime_r() may lock, so the handler uses the current UTC offset.
+    std::time_t now = std::time(0);
+    std::tm tm;
+    localtime_r(&now, &tm);
+    m_utc_offset = static_cast<long long>(tm.tm_gmtoff);
+
+    SignalStack::wanted().store(true, std::memory_order_release);
+    thread_instance<SignalStack>().install();
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = &CrashHandler::handle;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (std::size_t i = 0; i < signal_count; ++i)
+      if (!m_installed[i])
+        m_installed[i] = ::sigaction(signals()[i], &action, &m_previous[i]) == 0;
+  }
+
+private:
+  enum : std::size_t { signal_count = 3 };
+
+  static const int *signals() {
+    static const int list[signal_count] = {SIGSEGV, SIGABRT, SIGBUS};
+    return list;
+  }
+
+  CrashHandler() : m_fd(-1), m_colored(false), m_utc_offset(0), m_active(false) {
+    for (std::size_t i = 0; i < signal_count; ++i)
+      m_installed[i] = false;
+  }
+
+  static void handle(int signal) {
+    CrashHandler &handler = instance();
+    if (!handler.m_active.exchange(true))
+      handler.drain();
+    for (std::size_t i = 0; i < signal_count; ++i)
+      if (signals()[i] == signal && handler.m_installed[i])
+        ::sigaction(signal, &handler.m_previous[i], 0);
+    ::raise(signal);
+  }
+
+  // Writes the queued records oldest first, merging the thread buffers.
+  void drain() {
+    AsyncWriter &writer = AsyncWriter::instance();
+    std::uint64_t steady_offset = system_nanoseconds() - steady_nanoseconds();
+    CrashLine line;
+    char payload[4096];
+    for (;;) {
+      ThreadBuffer *oldest = 0;
+      std::uint64_t oldest_time = 0;
+      RecordHeader header;
+      for (std::size_t i = 0; i < AsyncWriter::max_buffers; ++i) {
+        ThreadBuffer *buffer = writer.buffer(i);
+        if (!buffer || !buffer->ring.front(header))
+          continue;
+        std::uint64_t time = timestamp(header, steady_offset);
+        if (!oldest || time < oldest_time) {
+          oldest = buffer;
+          oldest_time = time;
+        }
+      }
+      if (!oldest)
+        return;
+      if (!oldest->ring.try_pop(header, payload, sizeof(payload)))
+        continue;
+      render(line, header, timestamp(header, steady_offset), payload);
+      struct iovec iov;
+      iov.iov_base = const_cast<char *>(line.data());
+      iov.iov_len = line.size();
+      write_all(m_fd, &iov, 1);
+    }
+  }
+
+  static std::uint64_t timestamp(const RecordHeader &header,
+                                 std::uint64_t steady_offset) {
+    return header.flags & record_steady_clock
+               ? header.timestamp + steady_offset
+               : header.timestamp;
+  }
+
+  // [HH:MM:SS.mmm][LEVEL][CATEGORY] message
+  void render(CrashLine &line, const RecordHeader &header,
+              std::uint64_t timestamp, const char *payload) {
+    long long local = static_cast<long long>(timestamp / 1000000000) +
+                      m_utc_offset;
+    unsigned long long day = static_cast<unsigned long long>(
+        (local % 86400 + 86400) % 86400);
+    line.clear();
+    line.push_back('[');
+    line.number(day / 3600, 2);
+    line.push_back(':');
+    line.number(day / 60 % 60, 2);
+    line.push_back(':');
+    line.number(day % 60, 2);
+    line.push_back('.');
+    line.number(timestamp / 1000000 % 1000, 3);
+    line.push_back(']');
+    const LevelPrefix &prefix =
+        level_prefix(static_cast<Level>(header.level), m_colored);
+    line.append(prefix.data, prefix.size);
+    const std::string &category = Categories::instance().get(header.category).name;
+    if (!category.empty()) {
+      line.push_back('[');
+      line.append(category.data(), category.size());
+      line.push_back(']');
+    }
+    line.push_back(' ');
+    // Only the message; the fields would need formatting that allocates.
+    std::size_t size = header.size;
+    const char *fields;
+    std::size_t fields_size;
+    if (header.flags & record_fields)
+      split_fields(payload, size, fields, fields_size);
+    if (header.flags & record_deferred) {
+      CrashText text(line);
+      visit_deferred(payload, size, text);
+    } else {
+      line.append(payload, size);
+    }
+    if (m_colored)
+      line.append("\033[0m");
+    line.end_line();
+  }
+
+  int m_fd;
+  bool m_colored;
+  long long m_utc_offset; // seconds east of UTC when installed
+  std::atomic<bool> m_active;
+  bool m_installed[signal_count];
+  struct sigaction m_previous[signal_count];
+};
+
+// Hands a finished record to the writer thread, or to the sinks when it is
+// not running, and counts it in stats().
+inline void deliver(const RecordHeader &header, const char *data,
+                    std::size_t size) {
+  AsyncWriter &writer = AsyncWriter::instance();
+  bool kept = true;
+  if (writer.running()) {
+    kept = writer.push(header, data, size);
+    if (urgent(static_cast<Level>(header.level)))
+      log::flush();
+  } else {
+    write_now(header, data, size);
+  }
+  StatsRegistry::instance().count(header, size, kept);
+}
+
+// Settings of enable_backtrace(). Every call bumps the generation, which
+// makes the threads drop the rings they filled before.
+struct BacktraceConfig {
+  BacktraceConfig() : size(0), generation(0) {}
+
+  std::atomic<std::size_t> size; // bytes per thread, zero: disabled
+  std::atomic<unsigned> generation;
+};
+
+inline BacktraceConfig &backtrace_config() {
+  static BacktraceConfig config;
+  return config;
+}
+
+// The records of a thread that its runtime level filtered out, kept in their
+// queued form, so deferred statements are only formatted if they are dumped.
+struct Backtrace {
+  Backtrace() : generation(0) {}
+
+  std::unique_ptr<RingBuffer> ring;
+  unsigned generation; // of the config the ring was made for
+  std::string scratch;
+};
+
+inline Backtrace &thread_backtrace() { return thread_instance<Backtrace>(); }
+
+// Whether the thread's ring belongs to the current config; drops it if not.
+inline bool current(Backtrace &backtrace) {
+  if (backtrace.generation ==
+      backtrace_config().generation.load(std::memory_order_acquire))
+    return true;
+  backtrace.ring.reset();
+  return false;
+}
+
+// Keeps a record in the thread's ring, evicting the oldest ones as needed.
+inline void keep_back(RecordHeader header, const LineBuffer &line) {
+  Backtrace &backtrace = thread_backtrace();
+  if (!backtrace.ring || !current(backtrace)) {
+    BacktraceConfig &config = backtrace_config();
+    backtrace.generation = config.generation.load(std::memory_order_acquire);
+    std::size_t size = config.size.load(std::memory_order_relaxed);
+    if (size == 0)
+      return;
+    backtrace.ring.reset(new RingBuffer(size));
+  }
+  if (line.size() > backtrace.ring->max_payload())
+    return;
+  header.size = static_cast<std::uint32_t>(line.size());
+  RecordHeader oldest;
+  while (!backtrace.ring->try_push(header, line.data()))
+    backtrace.ring->discard_oldest(oldest);
+}
+
+// Writes out the records kept by the calling thread, oldest first.
+inline void dump_backtrace() {
+  Backtrace &backtrace = thread_backtrace();
+  if (!backtrace.ring || !current(backtrace))
+    return;
+  RecordHeader header;
+  while (backtrace.ring->try_pop(header, backtrace.scratch))
+    deliver(header, backtrace.scratch.data(), backtrace.scratch.size());
+}
+
+LOG_API bool reaches_sink(Level level) {
+  return AsyncWriter::instance().binary() ||
+         SinkList::instance().accepts(level);
+}
+
+LOG_API void submit(const RecordHeader &header, const LineBuffer &line) {
+  int level = severity(static_cast<Level>(header.level));
+  const Category &category = Categories::instance().get(header.category);
+  if (level < category.sink_level.load(std::memory_order_relaxed)) {
+    keep_back(header, line);
+    return;
+  }
+  if (level >= severity(Level::Error))
+    dump_backtrace();
+  deliver(header, line.data(), line.size());
+}
+
+// One thread's statistics for one site. Only the owning thread writes, so
+// plain loads and stores suffice; they are atomic for the thread printing
+// the summary.
+struct ScopeStats {
+  ScopeStats() : count(0), total(0), min(~0ULL), max(0) {
+    for (std::size_t i = 0; i < profile_buckets; ++i)
+      buckets[i].store(0, std::memory_order_relaxed);
+  }
+
+  void add(std::uint64_t nanoseconds) {
+    bump(count, 1);
+    bump(total, nanoseconds);
+    if (nanoseconds < min.load(std::memory_order_relaxed))
+      min.store(nanoseconds, std::memory_order_relaxed);
+    if (nanoseconds > max.load(std::memory_order_relaxed))
+      max.store(nanoseconds, std::memory_order_relaxed);
+    bump(buckets[profile_bucket(nanoseconds)], 1);
+  }
+
+  static void bump(std::atomic<std::uint64_t> &value, std::uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+  }
+
+  std::atomic<std::uint64_t> count;
+  std::atomic<std::uint64_t> total;
+  std::atomic<std::uint64_t> min;
+  std::atomic<std::uint64_t> max;
+  std::atomic<std::uint64_t> buckets[profile_buckets];
+};
+
+// Statistics of one site merged over threads, as printed by the summary.
+struct ScopeSummary {
+  ScopeSummary() : site(0), count(0), total(0), min(~0ULL), max(0) {
+    std::fill(buckets, buckets + profile_buckets, 0);
+  }
+
+  void merge(const ScopeStats &stats) {
+    count += stats.count.load(std::memory_order_relaxed);
+    total += stats.total.load(std::memory_order_relaxed);
+    min = std::min<std::uint64_t>(min, stats.min.load(std::memory_order_relaxed));
+    max = std::max<std::uint64_t>(max, stats.max.load(std::memory_order_relaxed));
+    for (std::size_t i = 0; i < profile_buckets; ++i)
+      buckets[i] += stats.buckets[i].load(std::memory_order_relaxed);
+  }
+
+  // Upper bound of the duration below which a fraction of the scopes
+  // finished, read off the histogram.
+  std::uint64_t percentile(double fraction) const {
+    std::uint64_t rank = static_cast<std::uint64_t>(fraction * count);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < profile_buckets; ++i) {
+      seen += buckets[i];
+      if (seen > rank)
+        return i + 1 < profile_buckets
+                   ? std::min(max, profile_bucket_floor(i + 1) - 1)
+                   : max;
+    }
+    return max;
+  }
+
+  const ProfileSite *site;
+  std::uint64_t count;
+  std::uint64_t total;
+  std::uint64_t min;
+  std::uint64_t max;
+  std::uint64_t buckets[profile_buckets];
+};
+
+// A node of a thread's call tree: one chain of nested sites from the
+// outermost scope down. Like ScopeStats only the owning thread writes;
+// children are prepended to an atomic list so the summary can walk it.
+struct ScopeNode {
+  ScopeNode(const ProfileSite *site, ScopeNode *parent)
+      : site(site), parent(parent), depth(parent ? parent->depth + 1 : 0),
+        count(0), inclusive(0), children(0), first_child(0), next_sibling(0) {}
+
+  ~ScopeNode() {
+    for (ScopeNode *node = first_child.load(std::memory_order_relaxed); node;) {
+      ScopeNode *next = node->next_sibling.load(std::memory_order_relaxed);
+      delete node;
+      node = next;
+    }
+  }
+
+  ScopeNode *child(const ProfileSite &site) {
+    ScopeNode *node = first_child.load(std::memory_order_relaxed);
+    for (; node; node = node->next_sibling.load(std::memory_order_relaxed))
+      if (node->site == &site)
+        return node;
+    node = new ScopeNode(&site, this);
+    node->next_sibling.store(first_child.load(std::memory_order_relaxed),
+                             std::memory_order_relaxed);
+    first_child.store(node, std::memory_order_release);
+    return node;
+  }
+
+  const ProfileSite *site; // null for the root
+  ScopeNode *parent;
+  std::size_t depth;
+  std::atomic<std::uint64_t> count;
+  std::atomic<std::uint64_t> inclusive; // nanoseconds including children
+  std::atomic<std::uint64_t> children;  // inclusive time of the children
+  std::atomic<ScopeNode *> first_child;
+  std::atomic<ScopeNode *> next_sibling;
+};
+
+// Call trees merged over threads, as printed by profile_tree().
+struct TreeSummary {
+  TreeSummary() : site(0), count(0), inclusive(0), children_time(0) {}
+
+  void merge(const ScopeNode &node) {
+    count += node.count.load(std::memory_order_relaxed);
+    inclusive += node.inclusive.load(std::memory_order_relaxed);
+    children_time += node.children.load(std::memory_order_relaxed);
+    for (const ScopeNode *child = node.first_child.load(std::memory_order_acquire);
+         child; child = child->next_sibling.load(std::memory_order_acquire)) {
+      std::size_t i = 0;
+      while (i < children.size() && children[i].site != child->site)
+        ++i;
+      if (i == children.size()) {
+        children.push_back(TreeSummary());
+        children.back().site = child->site;
+      }
+      children[i].merge(*child);
+    }
+  }
+
+  std::uint64_t exclusive() const {
+    return inclusive > children_time ? inclusive - children_time : 0;
+  }
+
+  const ProfileSite *site;
+  std::uint64_t count;
+  std::uint64_t inclusive;
+  std::uint64_t children_time;
+  std::vector<TreeSummary> children;
+};
+
+// Registry behind the aggregating ScopeLogger. Every thread owns a table of
+// ScopeStats, one per site, allocated on the site's first scope in that
+// thread, and a call tree whose current node is the innermost open scope. A
+// thread's statistics are folded into m_retired when it exits. Leaked on
+// purpose, like Categories.
+class Profiler {
+public:
+  enum : std::size_t { max_sites = 1024, max_depth = profile_max_depth };
+
+  static Profiler &instance() {
+    static Profiler *profiler = new Profiler();
+    return *profiler;
+  }
+
+  bool aggregating() const {
+    return m_mode.load(std::memory_order_relaxed) ==
+           static_cast<int>(ProfileMode::Aggregate);
+  }
+
+  void set_mode(ProfileMode mode, std::chrono::milliseconds interval) {
+    m_interval.store(to_nanoseconds(interval), std::memory_order_relaxed);
+    m_next_summary.store(interval.count() > 0
+                             ? steady_nanoseconds() + to_nanoseconds(interval)
+                             : 0,
+                         std::memory_order_relaxed);
+    m_mode.store(static_cast<int>(mode), std::memory_order_relaxed);
+  }
+
+  std::size_t add(const ProfileSite &site) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_sites.size() == max_sites)
+      return max_sites;
+    m_sites.push_back(&site);
+    return m_sites.size() - 1;
+  }
+
+  // Opens a scope of site below the innermost open one of this thread.
+  // Returns null past max_depth levels of nesting, where scopes only count in
+  // the flat statistics.
+  ScopeNode *enter(const ProfileSite &site) {
+    ThreadStats &stats = local();
+    if (stats.current->depth == max_depth)
+      return 0;
+    stats.current = stats.current->child(site);
+    return stats.current;
+  }
+
+  // Closes a scope opened by enter(); now is the steady clock at its end.
+  // Prints the summary from this thread when the interval given to
+  // set_mode() is up.
+  void record(const ProfileSite &site, ScopeNode *node, std::uint64_t duration,
+              std::uint64_t now) {
+    ThreadStats &stats = local();
+    if (site.id < max_sites)
+      stats.stats(site.id).add(duration);
+    if (node) {
+      ScopeStats::bump(node->count, 1);
+      ScopeStats::bump(node->inclusive, duration);
+      ScopeStats::bump(node->parent->children, duration);
+      stats.current = node->parent;
+    }
+    std::uint64_t due = m_next_summary.load(std::memory_order_relaxed);
+    if (due != 0 && now >= due &&
+        m_next_summary.compare_exchange_strong(
+            due, now + m_interval.load(std::memory_order_relaxed),
+            std::memory_order_relaxed))
+      summary();
+  }
+
+  // Statistics since the start, the sites with the most total time first.
+  std::vector<ScopeSummary> collect() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<ScopeSummary> summaries(m_retired);
+    summaries.resize(m_sites.size());
+    for (std::size_t id = 0; id < m_sites.size(); ++id) {
+      summaries[id].site = m_sites[id];
+      for (std::size_t i = 0; i < m_threads.size(); ++i)
+        if (const ScopeStats *stats = m_threads[i]->find(id))
+          summaries[id].merge(*stats);
+    }
+    std::vector<ScopeSummary> used;
+    for (std::size_t id = 0; id < summaries.size(); ++id)
+      if (summaries[id].count != 0)
+        used.push_back(summaries[id]);
+    std::stable_sort(used.begin(), used.end(), more_total);
+    return used;
+  }
+
+  // The call trees of all threads since the start, merged by call path.
+  TreeSummary collect_tree() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    TreeSummary root(m_retired_tree);
+    for (std::size_t i = 0; i < m_threads.size(); ++i)
+      root.merge(m_threads[i]->root);
+    return root;
+  }
+
+  void summary();
+  void tree();
+
+private:
+  class ThreadStats {
+  public:
+    ThreadStats() : root(0, 0), current(&root) {
+      for (std::size_t i = 0; i < max_sites; ++i)
+        m_stats[i].store(0, std::memory_order_relaxed);
+    }
+
+    ~ThreadStats() {
+      for (std::size_t i = 0; i < max_sites; ++i)
+        delete m_stats[i].load(std::memory_order_relaxed);
+    }
+
+    ScopeStats &stats(std::size_t id) {
+      ScopeStats *stats = m_stats[id].load(std::memory_order_relaxed);
+      if (!stats) {
+        stats = new ScopeStats();
+        m_stats[id].store(stats, std::memory_order_release);
+      }
+      return *stats;
+    }
+
+    const ScopeStats *find(std::size_t id) const {
+      return m_stats[id].load(std::memory_order_acquire);
+    }
+
+    ScopeNode root;
+    ScopeNode *current; // only used by the owning thread
+
+  private:
+    std::atomic<ScopeStats *> m_stats[max_sites];
+  };
+
+  struct LocalHandle {
+    std::shared_ptr<ThreadStats> stats;
+
+    ~LocalHandle() {
+      if (stats)
+        Profiler::instance().retire(stats);
+    }
+  };
+
+  Profiler()
+      : m_mode(static_cast<int>(ProfileMode::Lines)), m_interval(0),
+        m_next_summary(0) {}
+
+  ThreadStats &local() {
+    LocalHandle &handle = thread_instance<LocalHandle>();
+    if (!handle.stats) {
+      handle.stats = std::make_shared<ThreadStats>();
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_threads.push_back(handle.stats);
+    }
+    return *handle.stats;
+  }
+
+  void retire(const std::shared_ptr<ThreadStats> &stats) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_retired.resize(m_sites.size());
+    for (std::size_t id = 0; id < m_sites.size(); ++id)
+      if (const ScopeStats *scope = stats->find(id))
+        m_retired[id].merge(*scope);
+    m_retired_tree.merge(stats->root);
+    m_threads.erase(std::find(m_threads.begin(), m_threads.end(), stats));
+  }
+
+  static bool more_total(const ScopeSummary &lhs, const ScopeSummary &rhs) {
+    return lhs.total > rhs.total;
+  }
+
+  static bool more_inclusive(const TreeSummary *lhs, const TreeSummary *rhs) {
+    return lhs->inclusive > rhs->inclusive;
+  }
+
+  static void print(const TreeSummary &node, std::size_t depth);
+
+  std::mutex m_mutex;
+  std::vector<const ProfileSite *> m_sites;
+  std::vector<std::shared_ptr<ThreadStats> > m_threads;
+  std::vector<ScopeSummary> m_retired; // of exited threads, by site id
+  TreeSummary m_retired_tree;
+  std::atomic<int> m_mode;
+  std::atomic<std::uint64_t> m_interval;
+  std::atomic<std::uint64_t> m_next_summary; // zero: no periodic summary
+};
+
+LOG_API ProfileSite::ProfileSite(const char *tag, const char *file, int line)
+    : tag(tag), file(file), line(line), id(Profiler::instance().add(*this)) {}
+
+// Logs a line of the reports below as log_profiling() would. The reports are
+// asked for explicitly, so only the runtime level applies.
+inline void profile_report(const std::string &text) {
+  if (severity(Level::Profile) >=
+      Categories::instance().get(0).level.load(std::memory_order_relaxed))
+    emit(Level::Profile, 0, text);
+}
+
+inline void append_duration(std::ostream &out, std::uint64_t nanoseconds) {
+  if (nanoseconds < 1000)
+    out << nanoseconds << "ns";
+  else if (nanoseconds < 1000000)
+    out << nanoseconds / 1e3 << "us";
+  else if (nanoseconds < 1000000000)
+    out << nanoseconds / 1e6 << "ms";
+  else
+    out << nanoseconds / 1e9 << "s";
+}
+
+// One Profile record per site:
+//   tag @ file:line count N total T mean M min A p50 B p90 C p99 D max E
+inline void Profiler::summary() {
+  std::vector<ScopeSummary> summaries = collect();
+  for (std::size_t i = 0; i < summaries.size(); ++i) {
+    const ScopeSummary &scope = summaries[i];
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1) << "SUMMARY " << scope.site->tag
+        << " @ " << scope.site->file << ":" << scope.site->line << " count "
+        << scope.count << " total ";
+    append_duration(oss, scope.total);
+    oss << " mean ";
+    append_duration(oss, scope.total / scope.count);
+    oss << " min ";
+    append_duration(oss, scope.min);
+    oss << " p50 ";
+    append_duration(oss, scope.percentile(0.5));
+    oss << " p90 ";
+    append_duration(oss, scope.percentile(0.9));
+    oss << " p99 ";
+    append_duration(oss, scope.percentile(0.99));
+    oss << " max ";
+    append_duration(oss, scope.max);
+    profile_report(oss.str());
+  }
+}
+
+// One Profile record per call path, children below their parent with the
+// most inclusive time first:
+//   TREE <indent>tag @ file:line count N inclusive I exclusive E
+inline void Profiler::tree() { print(collect_tree(), 0); }
+
+inline void Profiler::print(const TreeSummary &node, std::size_t depth) {
+  std::vector<const TreeSummary *> children;
+  for (std::size_t i = 0; i < node.children.size(); ++i)
+    children.push_back(&node.children[i]);
+  std::stable_sort(children.begin(), children.end(), more_inclusive);
+  for (std::size_t i = 0; i < children.size(); ++i) {
+    const TreeSummary &child = *children[i];
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1) << "TREE "
+        << std::string(2 * depth, ' ') << child.site->tag << " @ "
+        << child.site->file << ":" << child.site->line << " count "
+        << child.count << " inclusive ";
+    append_duration(oss, child.inclusive);
+    oss << " exclusive ";
+    append_duration(oss, child.exclusive());
+    profile_report(oss.str());
+    print(child, depth + 1);
+  }
+}
+
+// Profile records with the counters that are not zero:
+//   STATS level L emitted N dropped D bytes B
+//   STATS category C emitted N dropped D bytes B
+//   STATS queue high-water B bytes
+//   STATS batches count N mean M p50 A p99 B max C
+//   STATS flush count N mean M p50 A p99 B max C
+inline void StatsRegistry::dump() {
+  Stats stats = snapshot();
+  for (std::size_t i = 0; i < Stats::level_count; ++i) {
+    const Stats::Counters &counters = stats.levels[i];
+    if (counters.emitted == 0 && counters.dropped == 0)
+      continue;
+    std::ostringstream oss;
+    oss << "STATS level " << level_name(static_cast<Level>(i)) << " emitted "
+        << counters.emitted << " dropped " << counters.dropped << " bytes "
+        << counters.bytes;
+    profile_report(oss.str());
+  }
+  for (std::size_t i = 0; i < stats.categories.size(); ++i) {
+    const Stats::Counters &counters = stats.categories[i].second;
+    const std::string &name = stats.categories[i].first;
+    std::ostringstream oss;
+    oss << "STATS category " << (name.empty() ? "-" : name) << " emitted "
+        << counters.emitted << " dropped " << counters.dropped << " bytes "
+        << counters.bytes;
+    profile_report(oss.str());
+  }
+  if (stats.queue_high_water != 0) {
+    std::ostringstream oss;
+    oss << "STATS queue high-water " << stats.queue_high_water << " bytes";
+    profile_report(oss.str());
+  }
+  const Stats::Histogram &batches = stats.batch_sizes;
+  if (batches.count != 0) {
+    std::ostringstream oss;
+    oss << "STATS batches count " << batches.count << " mean "
+        << batches.total / batches.count << " p50 " << batches.percentile(0.5)
+        << " p99 " << batches.percentile(0.99) << " max " << batches.max;
+    profile_report(oss.str());
+  }
+  const Stats::Histogram &flush = stats.flush_latency;
+  if (flush.count != 0) {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(1) << "STATS flush count "
+        << flush.count << " mean ";
+    append_duration(oss, flush.total / flush.count);
+    oss << " p50 ";
+    append_duration(oss, flush.percentile(0.5));
+    oss << " p99 ";
+    append_duration(oss, flush.percentile(0.99));
+    oss << " max ";
+    append_duration(oss, flush.max);
+    profile_report(oss.str());
+  }
+}
+
+// Collects log_profile() scopes as Chrome Trace Event "X" (complete) events
+// while start_trace() is in effect. Every thread appends to its own buffer and
+// writes batch_events of them at a time; stop() writes what the threads still
+// hold and closes the JSON array. Leaked on purpose, like Profiler.
+class TraceWriter {
+public:
+  enum : std::size_t { batch_events = 1024 };
+
+  static TraceWriter &instance() {
+    static TraceWriter *writer = new TraceWriter();
+    return *writer;
+  }
+
+  bool active() const { return m_active.load(std::memory_order_relaxed); }
+
+  bool start(const std::string &path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd >= 0)
+      return false;
+    int fd =
+        ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      std::clog << "log: cannot open " << path << '\n';
+      return false;
+    }
+    for (std::size_t i = 0; i < m_threads.size(); ++i) {
+      std::lock_guard<std::mutex> thread_lock(m_threads[i]->mutex);
+      m_threads[i]->events.clear();
+    }
+    std::lock_guard<std::mutex> file_lock(m_file_mutex);
+    m_fd = fd;
+    m_pid = static_cast<long long>(::getpid());
+    m_first = true;
+    write_text("[", 1);
+    m_active.store(true, std::memory_order_relaxed);
+    return true;
+  }
+
+  void stop() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_active.store(false, std::memory_order_relaxed);
+    for (std::size_t i = 0; i < m_threads.size(); ++i) {
+      std::lock_guard<std::mutex> thread_lock(m_threads[i]->mutex);
+      write(*m_threads[i]);
+    }
+    std::lock_guard<std::mutex> file_lock(m_file_mutex);
+    if (m_fd < 0)
+      return;
+    write_text("\n]\n", 3);
+    ::close(m_fd);
+    m_fd = -1;
+  }
+
+  // A scope of site that began at start (ProfileTimer nanoseconds).
+  void add(const ProfileSite &site, std::uint64_t start,
+           std::uint64_t duration) {
+    ThreadTrace &trace = local();
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    TraceEvent event = {&site, start, duration};
+    trace.events.push_back(event);
+    if (trace.events.size() == batch_events)
+      write(trace);
+  }
+
+private:
+  struct TraceEvent {
+    const ProfileSite *site;
+    std::uint64_t start;
+    std::uint64_t duration;
+  };
+
+  // The owning thread takes the mutex per event, uncontended except while
+  // start() or stop() walk the threads.
+  struct ThreadTrace {
+    explicit ThreadTrace(long long tid) : tid(tid) {
+      events.reserve(batch_events);
+    }
+
+    std::mutex mutex;
+    long long tid;
+    std::vector<TraceEvent> events;
+    LineBuffer text;
+  };
+
+  struct LocalHandle {
+    std::shared_ptr<ThreadTrace> trace;
+
+    ~LocalHandle() {
+      if (trace)
+        TraceWriter::instance().retire(trace);
+    }
+  };
+
+  TraceWriter()
+      : m_fd(-1), m_pid(0), m_first(true), m_next_tid(0), m_active(false) {}
+
+  ThreadTrace &local() {
+    LocalHandle &handle = thread_instance<LocalHandle>();
+    if (!handle.trace) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      handle.trace = std::make_shared<ThreadTrace>(++m_next_tid);
+      m_threads.push_back(handle.trace);
+    }
+    return *handle.trace;
+  }
+
+  void retire(const std::shared_ptr<ThreadTrace> &trace) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    {
+      std::lock_guard<std::mutex> thread_lock(trace->mutex);
+      write(*trace);
+    }
+    m_threads.erase(std::find(m_threads.begin(), m_threads.end(), trace));
+  }
+
+  // Formats and writes the buffered events of a thread whose mutex is held,
+  // each preceded by a separator that the very first one of the file skips.
+  void write(ThreadTrace &trace) {
+    LineBuffer &text = trace.text;
+    text.clear();
+    for (std::size_t i = 0; i < trace.events.size(); ++i) {
+      const TraceEvent &event = trace.events[i];
+      text.append(",\n{\"name\":");
+      append_json_string(text, event.site->tag);
+      text.append(",\"cat\":\"profile\",\"ph\":\"X\",\"ts\":");
+      append_microseconds(text, event.start);
+      text.append(",\"dur\":");
+      append_microseconds(text, event.duration);
+      text.append(",\"pid\":");
+      append_signed(text, m_pid);
+      text.append(",\"tid\":");
+      append_signed(text, trace.tid);
+      text.append(",\"args\":{\"file\":");
+      append_json_string(text, event.site->file);
+      text.append(",\"line\":");
+      append_signed(text, event.site->line);
+      text.append("}}");
+    }
+    trace.events.clear();
+    if (text.size() == 0)
+      return;
+    std::lock_guard<std::mutex> lock(m_file_mutex);
+    if (m_fd < 0)
+      return;
+    std::size_t skip = m_first ? 1 : 0;
+    m_first = false;
+    write_text(text.data() + skip, text.size() - skip);
+  }
+
+  void write_text(const char *data, std::size_t size) {
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(data);
+    iov.iov_len = size;
+    write_all(m_fd, &iov, 1);
+  }
+
+  // The trace format counts in microseconds; fractions keep the nanoseconds.
+  static void append_microseconds(LineBuffer &text, std::uint64_t nanoseconds) {
+    append_unsigned(text, nanoseconds / 1000);
+    unsigned fraction = static_cast<unsigned>(nanoseconds % 1000);
+    char digits[4] = {'.', static_cast<char>('0' + fraction / 100),
+                      static_cast<char>('0' + fraction / 10 % 10),
+                      static_cast<char>('0' + fraction % 10)};
+    text.append(digits, sizeof(digits));
+  }
+
+  std::mutex m_mutex; // guards m_threads, taken before any ThreadTrace::mutex
+  std::vector<std::shared_ptr<ThreadTrace> > m_threads;
+  std::mutex m_file_mutex; // guards the fields below, taken last
+  int m_fd;
+  long long m_pid;
+  bool m_first;
+  long long m_next_tid;
+  std::atomic<bool> m_active;
+};
+
+LOG_API bool profile_aggregating() {
+  return Profiler::instance().aggregating();
+}
+
+LOG_API ScopeNode *profile_enter(const ProfileSite &site) {
+  return Profiler::instance().enter(site);
+}
+
+LOG_API void profile_record(const ProfileSite &site, ScopeNode *node,
+                            std::uint64_t duration, std::uint64_t now) {
+  Profiler::instance().record(site, node, duration, now);
+}
+
+LOG_API bool trace_active() { return TraceWriter::instance().active(); }
+
+LOG_API void trace_add(const ProfileSite &site, std::uint64_t start,
+                       std::uint64_t duration) {
+  TraceWriter::instance().add(site, start, duration);
+}
+
+} // namespace detail
+
+LOG_API void start_async(const AsyncOptions &options) {
+  detail::AsyncWriter::instance().start(options);
+}
+
+LOG_API void flush() {
+  detail::AsyncWriter &writer = detail::AsyncWriter::instance();
+  if (writer.running())
+    writer.flush();
+  detail::SinkList &sinks = detail::SinkList::instance();
+  std::lock_guard<std::mutex> lock(sinks.mutex());
+  sinks.flush();
+}
+
+LOG_API void add_sink(const std::shared_ptr<Sink> &sink) {
+  detail::SinkList::instance().add(sink);
+}
+
+LOG_API void remove_sink(const std::shared_ptr<Sink> &sink) {
+  detail::AsyncWriter &writer = detail::AsyncWriter::instance();
+  if (writer.running())
+    writer.flush();
+  detail::SinkList::instance().remove(sink);
+}
+
+LOG_API void clear_sinks() {
+  detail::AsyncWriter &writer = detail::AsyncWriter::instance();
+  if (writer.running())
+    writer.flush();
+  detail::SinkList::instance().clear();
+}
+
+LOG_API void shutdown() { detail::AsyncWriter::instance().stop(); }
+
+LOG_API void install_crash_handler(int fd) {
+  detail::CrashHandler::instance().install(fd);
+}
+
+LOG_API bool decode_binary(std::istream &in, std::ostream &out) {
+  std::string data((std::istreambuf_iterator<char>(in)),
+                   std::istreambuf_iterator<char>());
+  detail::BinaryReader reader(data.data(), data.size());
+  const char *magic;
+  char version;
+  if (!reader.bytes(magic, sizeof(detail::binary_magic)) ||
+      std::memcmp(magic, detail::binary_magic, sizeof(detail::binary_magic)) ||
+      !reader.byte(version) || version != detail::binary_version)
+    return false;
+
+  std::vector<detail::BinarySite> sites;
+  std::vector<std::string> strings;
+  std::vector<detail::DeferredValue> values;
+  std::uint64_t timestamp = 0;
+  detail::TimestampCache timestamps;
+  detail::LineBuffer line;
+  // Sites and strings are numbered in the order they are written, so an id
+  // out of turn, which could make the tables huge, means a damaged file.
+  for (char entry; reader.byte(entry);) {
+    std::uint64_t id, value, size, format_size;
+    const char *bytes;
+    const char *format;
+    if (entry == detail::binary_site) {
+      if (!reader.varint(id) || !reader.varint(value) ||
+          !reader.varint(size) || !reader.bytes(bytes, size) ||
+          !reader.varint(format_size) || !reader.bytes(format, format_size) ||
+          id != sites.size())
+        return false;
+      sites.push_back(detail::BinarySite());
+      detail::BinarySite &site = sites.back();
+      site.level = static_cast<Level>(value);
+      site.category.assign(bytes, static_cast<std::size_t>(size));
+      site.format.assign(format, static_cast<std::size_t>(format_size));
+    } else if (entry == detail::binary_string) {
+      if (!reader.varint(id) || !reader.varint(size) ||
+          !reader.bytes(bytes, size) || id != strings.size())
+        return false;
+      strings.push_back(std::string(bytes, static_cast<std::size_t>(size)));
+    } else if (entry == detail::binary_record) {
+      if (!reader.varint(id) || id >= sites.size() || !reader.varint(value) ||
+          !reader.varint(size) || !reader.bytes(bytes, size))
+        return false;
+      timestamp += static_cast<std::uint64_t>(detail::unzigzag(value));
+      const detail::BinarySite &site = sites[static_cast<std::size_t>(id)];
+      line.clear();
+      detail::append_timestamp(line, timestamps, timestamp);
+      detail::append_prefix(line, site.level, site.category.data(),
+                            site.category.size());
+      detail::BinaryReader arguments(bytes, static_cast<std::size_t>(size));
+      if (!detail::decode_arguments(arguments, line, site, strings, values))
+        return false;
+      line.append("\033[0m\n");
+      out.write(line.data(), static_cast<std::streamsize>(line.size()));
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+LOG_API void set_profile_mode(ProfileMode mode,
+                              std::chrono::milliseconds interval) {
+  detail::Profiler::instance().set_mode(mode, interval);
+}
+
+LOG_API void profile_summary() { detail::Profiler::instance().summary(); }
+
+LOG_API void profile_tree() { detail::Profiler::instance().tree(); }
+
+LOG_API Stats stats() { return detail::StatsRegistry::instance().snapshot(); }
+
+LOG_API void stats_summary() { detail::StatsRegistry::instance().dump(); }
+
+LOG_API void set_stats_interval(std::chrono::milliseconds interval) {
+  detail::StatsRegistry::instance().set_interval(interval);
+}
+
+LOG_API void enable_backtrace(Level level, std::size_t bytes) {
+  detail::BacktraceConfig &config = detail::backtrace_config();
+  config.size.store(bytes != 0 ? bytes : 1, std::memory_order_relaxed);
+  config.generation.fetch_add(1, std::memory_order_release);
+  detail::Categories::instance().set_backtrace(detail::severity(level));
+}
+
+LOG_API void disable_backtrace() {
+  detail::Categories::instance().set_backtrace(
+      detail::Categories::no_backtrace);
+  detail::BacktraceConfig &config = detail::backtrace_config();
+  config.size.store(0, std::memory_order_relaxed);
+  config.generation.fetch_add(1, std::memory_order_release);
+}
+
+LOG_API void dump_backtrace() { detail::dump_backtrace(); }
+
+LOG_API bool start_trace(const std::string &path) {
+  return detail::TraceWriter::instance().start(path);
+}
+
+LOG_API void stop_trace() { detail::TraceWriter::instance().stop(); }
+
+} // namespace log
@@ -0,0 +1,2045 @@
+/*
+ * logger_core.hpp
+ * Copyright (c) 2025 João Pedro Foscarini
+ * SPDX-License-Identifier: MIT
+ *
+ * This file is licensed under the MIT License.
+ * You may obtain a copy of the license at:
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+
+// The part of the logger that every front-end shares: levels and categories,
+// records, the line buffers and timestamp caches, structured fields and the
+// sinks. logger_cpp11.hpp and logger_cpp23.hpp add the log statements on top;
+// the writer thread, the profiler and everything else behind the LOG_API
+// declarations is in logger_backend.hpp.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+// Compile-time minimum level. Statements below it are compiled out entirely;
+// NDEBUG builds strip every level unless LOG_COMPILE_LEVEL is set, e.g.
+// -DLOG_COMPILE_LEVEL=LOG_LEVEL_INFO keeps Info and above in release builds.
+#define LOG_LEVEL_TRACE     0
+#define LOG_LEVEL_DEBUG     1
+#define LOG_LEVEL_INFO      2
+#define LOG_LEVEL_NOTICE    3
+#define LOG_LEVEL_WARNING   4
+#define LOG_LEVEL_ERROR     5
+#define LOG_LEVEL_CRITICAL  6
+#define LOG_LEVEL_ALERT     7
+#define LOG_LEVEL_EMERGENCY 8
+#define LOG_LEVEL_OFF       9
+
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_OFF
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+#endif
+
+// Whether statements of a level survive LOG_COMPILE_LEVEL. A macro, and used
+// only by the log macros, so that translation units and the library built
+// from src/logger.cpp may see different levels without breaking the
+// one-definition rule.
+#define LOG_COMPILED(level) (log::detail::severity(level) >= LOG_COMPILE_LEVEL)
+
+// Header-only by default. With LOG_COMPILED_LIB the backend is left out of
+// the headers and built once, from src/logger.cpp, into the logger library.
+#ifdef LOG_COMPILED_LIB
+#define LOG_API
+#else
+#define LOG_API inline
+#endif
+
+namespace log {
+
+enum class Level { Trace, Debug, Info, Notice, Warning, Error, Critical, Alert, Emergency, Profile };
+
+enum class TimestampPrecision { Milliseconds, Microseconds, Nanoseconds };
+
+enum class OverflowPolicy { Block, DropNewest, DropOldest };
+
+// How a sink renders records, see Sink::set_encoding().
+// Text: [time][LEVEL][CATEGORY] message key=value...
+// Json: one JSON object per line with time, level, category, msg and fields.
+// Logfmt: time=... level=... category=... msg=... key=value...
+enum class Encoding { Text, Json, Logfmt };
+
+// What log_profile() scopes produce, see set_profile_mode().
+enum class ProfileMode { Lines, Aggregate };
+
+// How log_profile() scopes are timed, see set_profile_clock().
+enum class ProfileClock { Steady, Tsc };
+
+// System: the logging thread formats the wall-clock time itself.
+// Steady: the logging thread only reads steady_clock and the writer thread
+// converts the ticks to wall-clock time when it formats the record.
+enum class ClockSource { System, Steady };
+
+// How an idle writer thread waits for records. Sleep blocks on a condition
+// variable (a futex on Linux) for up to flush_interval, Yield gives up the
+// CPU between passes and Spin polls without pause, trading a core for the
+// lowest delay.
+enum class IdleStrategy { Sleep, Yield, Spin };
+
+struct AsyncOptions {
+  // Bytes of ring buffer per producer thread. After a restart with another
+  // size, a thread moves to a new buffer once its old one has been drained.
+  std::size_t thread_buffer_size;
+  std::size_t batch_size;         // records per write
+  std::chrono::microseconds flush_interval;
+  OverflowPolicy overflow;
+  ClockSource clock;
+  // When set, records are written to this file in the binary format read by
+  // decode_binary() instead of going to the sinks.
+  std::string binary_file;
+  // When not zero, a record that repeats the previous one written (same
+  // call site, level, category, message and fields) within this window of
+  // its first occurrence is only counted, and a "last message repeated N
+  // times" line follows the run. Does not apply to binary_file.
+  std::chrono::milliseconds dedup_window;
+  // Number of writer threads; 0 starts one per NUMA node. A producer thread's
+  // buffer belongs to the writer of the node it logged its first record on
+  // (node modulo writers), and records are merged by timestamp within a
+  // writer only. binary_file always uses a single writer.
+  std::size_t writers;
+  // CPUs to pin the writer threads to, writer i to writer_cpus[i % size()].
+  // Empty leaves them to the scheduler.
+  std::vector<int> writer_cpus;
+  IdleStrategy idle;
+
+  AsyncOptions()
+      : thread_buffer_size(256 * 1024), batch_size(256),
+        flush_interval(1000), overflow(OverflowPolicy::Block),
+        clock(ClockSource::System), dedup_window(0), writers(1),
+        idle(IdleStrategy::Sleep) {}
+};
+
+namespace detail {
+
+// Profile records are filtered like Debug.
+constexpr int severity(Level level) {
+  return static_cast<int>(level == Level::Profile ? Level::Debug : level);
+}
+
+// Critical records and above are written out before the statement returns,
+// also in asynchronous mode.
+constexpr bool urgent(Level level) {
+  return severity(level) >= severity(Level::Critical);
+}
+
+// Log-linear histogram buckets, for profile durations and the logger's own
+// statistics: exact below 4, then four buckets per power of two, so a bucket
+// is at most 25% wide.
+enum : std::size_t { profile_buckets = 252 };
+
+inline std::size_t profile_bucket(std::uint64_t value) {
+  if (value < 4)
+    return static_cast<std::size_t>(value);
+#if defined(__GNUC__)
+  unsigned exponent = 63 - static_cast<unsigned>(__builtin_clzll(value));
+#else
+  unsigned exponent = 0;
+  for (std::uint64_t rest = value; rest >>= 1;)
+    ++exponent;
+#endif
+  return (exponent - 1) * 4 + ((value >> (exponent - 2)) & 3);
+}
+
+// The smallest value that falls into a bucket.
+inline std::uint64_t profile_bucket_floor(std::size_t bucket) {
+  if (bucket < 4)
+    return bucket;
+  return static_cast<std::uint64_t>(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+// A category interned by Categories. Entries never move, so call sites keep a
+// reference to theirs while records only carry the 16-bit id.
+struct Category {
+  Category() : id(0), level(0), sink_level(0), overridden(false) {}
+
+  std::uint16_t id;
+  std::atomic<int> level;      // statements below it are not evaluated
+  std::atomic<int> sink_level; // records below it go to the backtrace
+  bool overridden;
+  std::string name;
+};
+
+// Registry of categories. Names are interned once per call site; after that
+// filtering and formatting are lookups by id. Every category has an effective
+// runtime level, and set(Level) changes it for those not set explicitly.
+// While a backtrace is enabled, statements are evaluated down to the lower of
+// that level and the backtrace level.
+class Categories {
+public:
+  // Leaked on purpose so statements in static destructors still work.
+  static Categories &instance() {
+    static Categories *categories = new Categories();
+    return *categories;
+  }
+
+  // Returns the named category, registering it on first use. Once all ids
+  // are taken new names share the uncategorized entry.
+  Category &intern(const std::string &name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return entry(name);
+  }
+
+  const Category &get(std::uint16_t id) const {
+    return m_chunks[id / chunk_size].load(std::memory_order_acquire)
+        [id % chunk_size];
+  }
+
+  void set(Level level) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_default = severity(level);
+    for (std::size_t id = 0; id < m_count; ++id) {
+      Category &target = at(id);
+      if (!target.overridden)
+        apply(target, m_default);
+    }
+  }
+
+  void set(const std::string &name, Level level) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Category &target = entry(name);
+    target.overridden = true;
+    apply(target, severity(level));
+  }
+
+  void reset(const std::string &name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Category &target = entry(name);
+    target.overridden = false;
+    apply(target, m_default);
+  }
+
+  // Records from `level` up that the runtime level filters out are kept;
+  // no_backtrace keeps none.
+  void set_backtrace(int level) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_backtrace = level;
+    for (std::size_t id = 0; id < m_count; ++id) {
+      Category &target = at(id);
+      apply(target, target.sink_level.load(std::memory_order_relaxed));
+    }
+  }
+
+  enum : int { no_backtrace = INT_MAX };
+
+private:
+  enum : std::size_t { chunk_size = 256, chunk_count = 256 };
+
+  Categories()
+      : m_count(0), m_default(severity(Level::Trace)),
+        m_backtrace(no_backtrace) {
+    for (std::size_t i = 0; i < chunk_count; ++i)
+      m_chunks[i].store(nullptr, std::memory_order_relaxed);
+    entry(std::string());
+  }
+
+  Category &at(std::size_t id) {
+    return m_chunks[id / chunk_size].load(std::memory_order_relaxed)
+        [id % chunk_size];
+  }
+
+  Category &entry(const std::string &name) {
+    std::unordered_map<std::string, std::uint16_t>::const_iterator it =
+        m_ids.find(name);
+    if (it != m_ids.end())
+      return at(it->second);
+    if (m_count == chunk_size * chunk_count)
+      return at(0);
+    if (m_count % chunk_size == 0)
+      m_chunks[m_count / chunk_size].store(new Category[chunk_size],
+                                           std::memory_order_release);
+    Category &target = at(m_count);
+    target.id = static_cast<std::uint16_t>(m_count);
+    apply(target, m_default);
+    target.name = name;
+    m_ids[name] = target.id;
+    ++m_count;
+    return target;
+  }
+
+  void apply(Category &target, int level) {
+    target.sink_level.store(level, std::memory_order_relaxed);
+    target.level.store(std::min(level, m_backtrace), std::memory_order_relaxed);
+  }
+
+  std::mutex m_mutex;
+  std::unordered_map<std::string, std::uint16_t> m_ids;
+  std::atomic<Category *> m_chunks[chunk_count];
+  std::size_t m_count;
+  int m_default;
+  int m_backtrace;
+};
+
+} // namespace detail
+
+// Sets the minimum level for every category without its own level.
+inline void set_level(Level level) {
+  detail::Categories::instance().set(level);
+}
+
+// Sets the minimum level of one category ("" is the uncategorized one).
+inline void set_level(const std::string &category, Level level) {
+  detail::Categories::instance().set(category, level);
+}
+
+// Makes a category follow the level given to set_level(Level) again.
+inline void reset_level(const std::string &category) {
+  detail::Categories::instance().reset(category);
+}
+
+// The logger's own counters since the start of the program, see stats().
+struct Stats {
+  enum : std::size_t {
+    level_count = static_cast<std::size_t>(Level::Profile) + 1
+  };
+
+  struct Counters {
+    Counters() : emitted(0), dropped(0), bytes(0) {}
+
+    std::uint64_t emitted; // records written, or queued and not dropped
+    std::uint64_t dropped; // lost to OverflowPolicy::DropNewest or DropOldest
+    std::uint64_t bytes;   // payload of the emitted records
+  };
+
+  // Samples in the buckets of detail::profile_bucket().
+  struct Histogram {
+    Histogram() : count(0), total(0), max(0), buckets(detail::profile_buckets) {}
+
+    // Upper bound of the value below which a fraction of the samples fell.
+    std::uint64_t percentile(double fraction) const {
+      std::uint64_t rank = static_cast<std::uint64_t>(fraction * count);
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen > rank)
+          return i + 1 < buckets.size()
+                     ? std::min(max, detail::profile_bucket_floor(i + 1) - 1)
+                     : max;
+      }
+      return max;
+    }
+
+    std::uint64_t count;
+    std::uint64_t total;
+    std::uint64_t max;
+    std::vector<std::uint64_t> buckets;
+  };
+
+  Stats() : queue_high_water(0) {}
+
+  Counters levels[level_count]; // indexed by Level
+  // The categories that logged, by name; "" is the uncategorized one.
+  std::vector<std::pair<std::string, Counters> > categories;
+  std::size_t queue_high_water; // most bytes queued in one thread's buffer
+  Histogram batch_sizes;        // records per write to the sinks
+  Histogram flush_latency;      // nanoseconds per pass of the writer thread
+};
+
+namespace detail {
+
+inline std::atomic<TimestampPrecision> &timestamp_precision() {
+  static std::atomic<TimestampPrecision> precision(
+      TimestampPrecision::Milliseconds);
+  return precision;
+}
+
+inline std::uint64_t to_nanoseconds(std::chrono::nanoseconds duration) {
+  return static_cast<std::uint64_t>(duration.count());
+}
+
+inline std::uint64_t system_nanoseconds() {
+  return to_nanoseconds(std::chrono::system_clock::now().time_since_epoch());
+}
+
+inline std::uint64_t steady_nanoseconds() {
+  return to_nanoseconds(std::chrono::steady_clock::now().time_since_epoch());
+}
+
+// Formats HH:MM:SS.fff for nanoseconds since the epoch. The local-time
+// conversion only runs when the second changes; the fraction digits are
+// patched in on every call.
+class TimestampCache {
+public:
+  static const std::size_t max_size = 18;
+
+  TimestampCache() : m_second(-1) {}
+
+  std::size_t format(char *out, std::uint64_t nanoseconds) {
+    std::time_t second = static_cast<std::time_t>(nanoseconds / 1000000000);
+    if (second != m_second) {
+      std::tm tm;
+#if defined(_WIN32)
+      localtime_s(&tm, &second);
+#else
+      localtime_r(&second, &tm);
+#endif
+      two_digits(m_prefix, tm.tm_hour);
+      m_prefix[2] = ':';
+      two_digits(m_prefix + 3, tm.tm_min);
+      m_prefix[5] = ':';
+      two_digits(m_prefix + 6, tm.tm_sec);
+      m_second = second;
+    }
+    std::memcpy(out, m_prefix, sizeof(m_prefix));
+    out[8] = '.';
+    return 9 + format_fraction(out + 9, nanoseconds);
+  }
+
+  // The sub-second digits of timestamp_precision(); returns their count.
+  static std::size_t format_fraction(char *out, std::uint64_t nanoseconds) {
+    std::uint32_t fraction =
+        static_cast<std::uint32_t>(nanoseconds % 1000000000);
+    std::size_t digits = 9;
+    switch (timestamp_precision().load(std::memory_order_relaxed)) {
+    case TimestampPrecision::Milliseconds:
+      fraction /= 1000000;
+      digits = 3;
+      break;
+    case TimestampPrecision::Microseconds:
+      fraction /= 1000;
+      digits = 6;
+      break;
+    case TimestampPrecision::Nanoseconds:
+      break;
+    }
+    for (std::size_t i = digits; i > 0; --i) {
+      out[i - 1] = static_cast<char>('0' + fraction % 10);
+      fraction /= 10;
+    }
+    return digits;
+  }
+
+  static void two_digits(char *out, int value) {
+    out[0] = static_cast<char>('0' + value / 10);
+    out[1] = static_cast<char>('0' + value % 10);
+  }
+
+private:
+  std::time_t m_second;
+  char m_prefix[8];
+};
+
+// UTC time in RFC 3339 form, 2024-05-01T12:03:10.512Z, for the Json and
+// Logfmt encodings. Like TimestampCache it formats the date and time once per
+// second and follows timestamp_precision().
+class UtcTimestampCache {
+public:
+  static const std::size_t max_size = 30;
+
+  UtcTimestampCache() : m_second(-1) {}
+
+  std::size_t format(char *out, std::uint64_t nanoseconds) {
+    std::time_t second = static_cast<std::time_t>(nanoseconds / 1000000000);
+    if (second != m_second) {
+      std::tm tm;
+#if defined(_WIN32)
+      gmtime_s(&tm, &second);
+#else
+      gmtime_r(&second, &tm);
+#endif
+      int year = tm.tm_year + 1900;
+      TimestampCache::two_digits(m_prefix, year / 100);
+      TimestampCache::two_digits(m_prefix + 2, year % 100);
+      m_prefix[4] = '-';
+      TimestampCache::two_digits(m_prefix + 5, tm.tm_mon + 1);
+      m_prefix[7] = '-';
+      TimestampCache::two_digits(m_prefix + 8, tm.tm_mday);
+      m_prefix[10] = 'T';
+      TimestampCache::two_digits(m_prefix + 11, tm.tm_hour);
+      m_prefix[13] = ':';
+      TimestampCache::two_digits(m_prefix + 14, tm.tm_min);
+      m_prefix[16] = ':';
+      TimestampCache::two_digits(m_prefix + 17, tm.tm_sec);
+      m_second = second;
+    }
+    std::memcpy(out, m_prefix, sizeof(m_prefix));
+    out[19] = '.';
+    std::size_t digits = TimestampCache::format_fraction(out + 20, nanoseconds);
+    out[20 + digits] = 'Z';
+    return 21 + digits;
+  }
+
+private:
+  std::time_t m_second;
+  char m_prefix[19];
+};
+
+// Character buffer with 512 bytes of inline storage. Longer lines spill into
+// a heap chunk that is kept for the next line, so a thread stops allocating
+// once it has seen its longest line.
+class LineBuffer {
+public:
+  typedef char value_type; // for std::back_inserter
+
+  LineBuffer() : m_data(m_inline), m_size(0), m_capacity(sizeof(m_inline)) {}
+
+  LineBuffer(const LineBuffer &) = delete;
+  LineBuffer &operator=(const LineBuffer &) = delete;
+
+  char *data() { return m_data; }
+  const char *data() const { return m_data; }
+  std::size_t size() const { return m_size; }
+  void clear() { m_size = 0; }
+
+  void append(const char *data, std::size_t size) {
+    if (m_size + size > m_capacity)
+      grow(m_size + size);
+    std::memcpy(m_data + m_size, data, size);
+    m_size += size;
+  }
+
+  void append(const char *text) { append(text, std::strlen(text)); }
+
+  void push_back(char c) {
+    if (m_size == m_capacity)
+      grow(m_size + 1);
+    m_data[m_size++] = c;
+  }
+
+  // Reserves room for `size` bytes; the caller writes them and then calls
+  // commit() with the number actually used.
+  char *reserve(std::size_t size) {
+    if (m_size + size > m_capacity)
+      grow(m_size + size);
+    return m_data + m_size;
+  }
+
+  void commit(std::size_t size) { m_size += size; }
+
+  // Drops everything after the first `size` bytes.
+  void truncate(std::size_t size) { m_size = size; }
+
+private:
+  void grow(std::size_t required) {
+    std::size_t capacity = m_capacity * 2;
+    while (capacity < required)
+      capacity *= 2;
+    std::unique_ptr<char[]> chunk(new char[capacity]);
+    std::memcpy(chunk.get(), m_data, m_size);
+    m_chunk.swap(chunk);
+    m_data = m_chunk.get();
+    m_capacity = capacity;
+  }
+
+  char m_inline[512];
+  char *m_data;
+  std::size_t m_size;
+  std::size_t m_capacity;
+  std::unique_ptr<char[]> m_chunk;
+};
+
+inline void append_unsigned(LineBuffer &line, unsigned long long value,
+                            bool negative = false) {
+  char digits[24];
+  char *end = digits + sizeof(digits);
+  char *begin = end;
+  do {
+    *--begin = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  if (negative)
+    *--begin = '-';
+  line.append(begin, static_cast<std::size_t>(end - begin));
+}
+
+inline void append_signed(LineBuffer &line, long long value) {
+  if (value < 0)
+    append_unsigned(line, 0ULL - static_cast<unsigned long long>(value), true);
+  else
+    append_unsigned(line, static_cast<unsigned long long>(value));
+}
+
+// Appends text as a JSON string literal, quotes included.
+inline void append_json_string(LineBuffer &line, const char *text,
+                               std::size_t size) {
+  static const char hex[] = "0123456789abcdef";
+  line.push_back('"');
+  for (const char *end = text + size; text != end; ++text) {
+    unsigned char c = static_cast<unsigned char>(*text);
+    if (c == '"' || c == '\\') {
+      line.push_back('\\');
+      line.push_back(*text);
+    } else if (c < 0x20) {
+      line.append("\\u00", 4);
+      line.push_back(hex[c >> 4]);
+      line.push_back(hex[c & 15]);
+    } else {
+      line.push_back(*text);
+    }
+  }
+  line.push_back('"');
+}
+
+inline void append_json_string(LineBuffer &line, const char *text) {
+  append_json_string(line, text, std::strlen(text));
+}
+
+inline void append_timestamp(LineBuffer &line, TimestampCache &cache,
+                             std::uint64_t nanoseconds) {
+  char *out = line.reserve(TimestampCache::max_size + 2);
+  out[0] = '[';
+  std::size_t written = 1 + cache.format(out + 1, nanoseconds);
+  out[written++] = ']';
+  line.commit(written);
+}
+
+inline const char *colorCode(Level level) {
+  switch (level) {
+  case Level::Trace: return "\033[1;37m";
+  case Level::Debug: return "\033[1;34m";
+  case Level::Info: return "\033[1;32m";
+  case Level::Notice: return "\033[1;36m";
+  case Level::Warning: return "\033[1;33m";
+  case Level::Error: return "\033[1;31m";
+  case Level::Critical: return "\033[1;35m";
+  case Level::Alert: return "\033[1;41m";
+  case Level::Emergency: return "\033[1;41;97m";
+  case Level::Profile: return "\033[1;36m";
+  default: return "\033[0m";
+  }
+}
+
+inline const char *levelLabel(Level level) {
+  switch (level) {
+  case Level::Trace:     return "  TRACE  ";
+  case Level::Debug:     return "  DEBUG  ";
+  case Level::Info:      return "  INFO   ";
+  case Level::Notice:    return " NOTICE  ";
+  case Level::Warning:   return " WARNING ";
+  case Level::Error:     return "  ERROR  ";
+  case Level::Critical:  return "CRITICAL ";
+  case Level::Alert:     return "  ALERT  ";
+  case Level::Emergency: return "EMERGENCY";
+  case Level::Profile:   return "PROFILING";
+  default:               return " UNKNOWN ";
+  }
+}
+
+// The level as the Json and Logfmt encodings spell it.
+inline const char *level_name(Level level) {
+  switch (level) {
+  case Level::Trace:     return "trace";
+  case Level::Debug:     return "debug";
+  case Level::Info:      return "info";
+  case Level::Notice:    return "notice";
+  case Level::Warning:   return "warning";
+  case Level::Error:     return "error";
+  case Level::Critical:  return "critical";
+  case Level::Alert:     return "alert";
+  case Level::Emergency: return "emergency";
+  case Level::Profile:   return "profile";
+  default:               return "unknown";
+  }
+}
+
+// The [LEVEL] part of a line, plain and colored, for every Level. The table
+// is constant-initialized so the prefix is a single memcpy of known length.
+struct LevelPrefix {
+  const char *data;
+  std::size_t size;
+};
+
+#define LOG_LEVEL_PREFIX(text) { text, sizeof(text) - 1 }
+
+inline const LevelPrefix &level_prefix(Level level, bool colored = true) {
+  static const LevelPrefix prefixes[][2] = {
+      {LOG_LEVEL_PREFIX("[  TRACE  ]"),
+       LOG_LEVEL_PREFIX("[\033[1;37m  TRACE  \033[0m]")},
+      {LOG_LEVEL_PREFIX("[  DEBUG  ]"),
+       LOG_LEVEL_PREFIX("[\033[1;34m  DEBUG  \033[0m]")},
+      {LOG_LEVEL_PREFIX("[  INFO   ]"),
+       LOG_LEVEL_PREFIX("[\033[1;32m  INFO   \033[0m]")},
+      {LOG_LEVEL_PREFIX("[ NOTICE  ]"),
+       LOG_LEVEL_PREFIX("[\033[1;36m NOTICE  \033[0m]")},
+      {LOG_LEVEL_PREFIX("[ WARNING ]"),
+       LOG_LEVEL_PREFIX("[\033[1;33m WARNING \033[0m]")},
+      {LOG_LEVEL_PREFIX("[  ERROR  ]"),
+       LOG_LEVEL_PREFIX("[\033[1;31m  ERROR  \033[0m]")},
+      {LOG_LEVEL_PREFIX("[CRITICAL ]"),
+       LOG_LEVEL_PREFIX("[\033[1;35mCRITICAL \033[0m]")},
+      {LOG_LEVEL_PREFIX("[  ALERT  ]"),
+       LOG_LEVEL_PREFIX("[\033[1;41m  ALERT  \033[0m]")},
+      {LOG_LEVEL_PREFIX("[EMERGENCY]"),
+       LOG_LEVEL_PREFIX("[\033[1;41;97mEMERGENCY\033[0m]")},
+      {LOG_LEVEL_PREFIX("[PROFILING]"),
+       LOG_LEVEL_PREFIX("[\033[1;36mPROFILING\033[0m]")},
+      {LOG_LEVEL_PREFIX("[ UNKNOWN ]"),
+       LOG_LEVEL_PREFIX("[\033[0m UNKNOWN \033[0m]")},
+  };
+  const std::size_t count = sizeof(prefixes) / sizeof(prefixes[0]);
+  std::size_t index = static_cast<std::size_t>(level);
+  return prefixes[index < count ? index : count - 1][colored ? 1 : 0];
+}
+
+#undef LOG_LEVEL_PREFIX
+
+// Everything between the timestamp and the message: [LEVEL][CATEGORY] and the
+// separating space.
+inline void append_prefix(LineBuffer &line, Level level, const char *category,
+                          std::size_t category_size, bool colored = true) {
+  const LevelPrefix &prefix = level_prefix(level, colored);
+  line.append(prefix.data, prefix.size);
+  if (category_size != 0) {
+    line.push_back('[');
+    line.append(category, category_size);
+    line.push_back(']');
+  }
+  line.push_back(' ');
+}
+
+struct DeferredFormatter;
+
+// Logged in place of a null const char *, which std::ostream would refuse
+// by setting badbit.
+const char null_string[] = "(null)";
+
+// The read-only segments of the executable, where its string literals are.
+// A deferred record only keeps the address of a char array found here; other
+// arrays may be locals and are copied. Shared libraries are left out, as they
+// may be unloaded before the record is formatted.
+class StaticText {
+public:
+  static bool contains(const void *data) {
+    static const StaticText text;
+    std::uintptr_t at = reinterpret_cast<std::uintptr_t>(data);
+    for (std::size_t i = 0; i < text.m_count; ++i)
+      if (at >= text.m_begin[i] && at < text.m_end[i])
+        return true;
+    return false;
+  }
+
+private:
+  enum : std::size_t { max_segments = 8 };
+
+  StaticText() : m_count(0) { ::dl_iterate_phdr(&StaticText::add, this); }
+
+  // The executable is the first object listed.
+  static int add(struct dl_phdr_info *info, std::size_t, void *data) {
+    StaticText &text = *static_cast<StaticText *>(data);
+    for (std::size_t i = 0; i < info->dlpi_phnum; ++i) {
+      const ElfW(Phdr) &segment = info->dlpi_phdr[i];
+      if (segment.p_type != PT_LOAD || (segment.p_flags & PF_W) ||
+          text.m_count == max_segments)
+        continue;
+      text.m_begin[text.m_count] = info->dlpi_addr + segment.p_vaddr;
+      text.m_end[text.m_count] =
+          text.m_begin[text.m_count] + segment.p_memsz;
+      ++text.m_count;
+    }
+    return 1;
+  }
+
+  std::uintptr_t m_begin[max_segments];
+  std::uintptr_t m_end[max_segments];
+  std::size_t m_count;
+};
+
+// Static description of a deferred call site; records only carry a pointer
+// to it. A format() statement keeps its format string here as well, and its
+// first call publishes the formatter, so its records only carry arguments.
+struct DeferredSite {
+  DeferredSite(Level level, std::uint16_t category, const char *format = 0,
+               std::size_t format_size = 0)
+      : level(level), category(category), format(format),
+        format_size(format_size), formatter(0) {}
+
+  Level level;
+  std::uint16_t category;
+  const char *format; // null for stream statements
+  std::size_t format_size;
+  mutable std::atomic<const DeferredFormatter *> formatter;
+};
+
+// Argument tags of the deferred encoding. Each tag byte is followed by the
+// raw value; strings are a 32-bit length and the bytes, literals the address
+// of a NUL-terminated string with static storage, calls a DeferredCall and
+// then the closure like a string. A format tag is followed by the arguments
+// the site's formatter reads; an inline format tag, for a statement its site
+// does not describe, first by a DeferredFormatter pointer and the format
+// string like a string.
+enum DeferredTag : char {
+  deferred_signed = 'i',
+  deferred_unsigned = 'u',
+  deferred_double = 'd',
+  deferred_char = 'c',
+  deferred_string = 's',
+  deferred_literal = 'p',
+  deferred_call = 'l',
+  deferred_format = 'f',
+  deferred_format_inline = 'F',
+  deferred_bool = 'b', // only in DeferredValue and the binary log
+};
+
+// Appends the result of a log::deferred() callable, given its bytes.
+typedef void (*DeferredCall)(const char *closure, LineBuffer &out);
+
+// One argument of a format() statement as a plain value, for the binary log.
+// Characters and bools are kept in signed_integer, strings in data and size.
+struct DeferredValue {
+  DeferredTag type;
+  long long signed_integer;
+  unsigned long long unsigned_integer;
+  double number;
+  const char *data;
+  std::size_t size;
+};
+
+// The formatter of a format() statement with given argument types.
+struct DeferredFormatter {
+  // Reads the arguments from in and appends the formatted text. Returns
+  // false when they are cut short.
+  bool (*format)(LineBuffer &out, const char *format, std::size_t size,
+                 const char *&in, const char *end);
+  // Reads the arguments from in as DeferredValues. Returns false when they
+  // are cut short or one has no such form.
+  bool (*split)(std::vector<DeferredValue> &values, const char *&in,
+                const char *end);
+};
+
+template <typename T>
+bool read_raw(const char *&in, const char *end, T &value) {
+  if (static_cast<std::size_t>(end - in) < sizeof(T))
+    return false;
+  std::memcpy(&value, in, sizeof(T));
+  in += sizeof(T);
+  return true;
+}
+
+enum RecordFlags : std::uint8_t {
+  record_steady_clock = 1u << 0, // the timestamp is steady_clock based
+  record_deferred = 1u << 1,     // the payload uses the deferred encoding
+  record_fields = 1u << 2,       // structured fields follow the message
+};
+
+// A log statement. The log macros keep one per call site, so records of
+// different statements can be told apart by its address.
+struct CallSite {
+  const char *file;
+  int line;
+};
+
+// A queued record. The payload is the message only; the sinks add the
+// timestamp and prefix.
+struct RecordHeader {
+  std::uint32_t size;
+  std::uint8_t flags;
+  std::uint8_t level;
+  std::uint16_t category;
+  std::uint64_t timestamp;
+  const CallSite *site; // null for the lines the logger writes itself
+};
+
+} // namespace detail
+
+// A finished record as sinks see it. The message has no timestamp, prefix or
+// newline.
+struct Record {
+  Level level;
+  std::uint16_t category;  // id in detail::Categories
+  std::uint64_t timestamp; // system clock, nanoseconds since the epoch
+  const char *message;
+  std::size_t size;
+  const char *fields; // Logger::kv() fields, read with detail::FieldReader
+  std::size_t fields_size;
+};
+
+namespace detail {
+
+// Structured fields travel after the message of a record flagged
+// record_fields, followed by the size of the field section as a uint32_t.
+// Each field is a type byte, a length byte and a key of up to 255 bytes, then
+// the value: 8 bytes for numbers, one for bool, and a uint32_t length and the
+// bytes for strings.
+enum FieldType : std::uint8_t {
+  field_string = 's',
+  field_signed = 'i',
+  field_unsigned = 'u',
+  field_double = 'd',
+  field_bool = 'b',
+};
+
+struct Field {
+  FieldType type;
+  const char *key;
+  std::size_t key_size;
+  const char *value; // the encoded value, see FieldType
+  std::size_t value_size;
+};
+
+inline void append_field_key(LineBuffer &fields, FieldType type,
+                             const char *key, std::size_t size) {
+  size = std::min<std::size_t>(size, 255);
+  fields.push_back(static_cast<char>(type));
+  fields.push_back(static_cast<char>(size));
+  fields.append(key, size);
+}
+
+inline void append_field_key(LineBuffer &fields, FieldType type,
+                             const char *key) {
+  append_field_key(fields, type, key, std::strlen(key));
+}
+
+template <typename T>
+void append_field(LineBuffer &fields, FieldType type, const char *key,
+                  T value) {
+  append_field_key(fields, type, key);
+  fields.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+inline void append_field(LineBuffer &fields, const char *key, const char *text,
+                         std::size_t size) {
+  append_field_key(fields, field_string, key);
+  std::uint32_t length = static_cast<std::uint32_t>(size);
+  fields.append(reinterpret_cast<const char *>(&length), sizeof(length));
+  fields.append(text, size);
+}
+
+class FieldReader {
+public:
+  FieldReader(const char *data, std::size_t size)
+      : m_data(data), m_left(data ? size : 0) {}
+
+  // False at the end of the fields, or where they are cut short.
+  bool next(Field &field) {
+    if (m_left < 2 || m_left - 2 < static_cast<unsigned char>(m_data[1]))
+      return false;
+    field.type = static_cast<FieldType>(m_data[0]);
+    field.key_size = static_cast<unsigned char>(m_data[1]);
+    field.key = m_data + 2;
+    std::size_t used = 2 + field.key_size;
+    std::size_t size = 8;
+    if (field.type == field_string) {
+      std::uint32_t length;
+      if (m_left - used < sizeof(length))
+        return false;
+      std::memcpy(&length, m_data + used, sizeof(length));
+      used += sizeof(length);
+      size = length;
+    } else if (field.type == field_bool) {
+      size = 1;
+    }
+    if (m_left - used < size)
+      return false;
+    field.value = m_data + used;
+    field.value_size = size;
+    m_data += used + size;
+    m_left -= used + size;
+    return true;
+  }
+
+private:
+  const char *m_data;
+  std::size_t m_left;
+};
+
+// Cuts the field section and its size off a record_fields payload, leaving
+// size at the length of the message.
+inline void split_fields(const char *data, std::size_t &size,
+                         const char *&fields, std::size_t &fields_size) {
+  std::uint32_t section = 0;
+  if (size >= sizeof(section))
+    std::memcpy(&section, data + size - sizeof(section), sizeof(section));
+  if (size < sizeof(section) || section > size - sizeof(section)) {
+    fields = 0;
+    fields_size = 0;
+    return;
+  }
+  size -= sizeof(section) + section;
+  fields = data + size;
+  fields_size = section;
+}
+
+// Shorter of %.15g and %.17g that reads back as the same value. JSON has no
+// NaN or infinity, so there they become null.
+inline void append_double(LineBuffer &out, double value, bool json) {
+  if (json && value - value != 0) {
+    out.append("null", 4);
+    return;
+  }
+  char *text = out.reserve(32);
+  int written = std::snprintf(text, 32, "%.15g", value);
+  if (std::strtod(text, 0) != value)
+    written = std::snprintf(text, 32, "%.17g", value);
+  out.commit(static_cast<std::size_t>(written));
+}
+
+// logfmt quotes values that are empty or hold spaces, quotes, '=' or control
+// characters, with JSON escapes.
+inline void append_logfmt_string(LineBuffer &out, const char *text,
+                                 std::size_t size) {
+  bool quote = size == 0;
+  for (std::size_t i = 0; i < size && !quote; ++i)
+    quote = static_cast<unsigned char>(text[i]) <= ' ' || text[i] == '"' ||
+            text[i] == '=' || text[i] == '\\';
+  if (quote)
+    append_json_string(out, text, size);
+  else
+    out.append(text, size);
+}
+
+inline void append_field_value(LineBuffer &out, const Field &field,
+                               bool json) {
+  switch (field.type) {
+  case field_string:
+    if (json)
+      append_json_string(out, field.value, field.value_size);
+    else
+      append_logfmt_string(out, field.value, field.value_size);
+    break;
+  case field_signed: {
+    long long value;
+    std::memcpy(&value, field.value, sizeof(value));
+    append_signed(out, value);
+    break;
+  }
+  case field_unsigned: {
+    unsigned long long value;
+    std::memcpy(&value, field.value, sizeof(value));
+    append_unsigned(out, value);
+    break;
+  }
+  case field_double: {
+    double value;
+    std::memcpy(&value, field.value, sizeof(value));
+    append_double(out, value, json);
+    break;
+  }
+  case field_bool:
+    out.append(*field.value ? "true" : "false");
+    break;
+  }
+}
+
+// " key=value" per field, as the Text encoding and logfmt end a line.
+inline void append_text_fields(LineBuffer &out, const char *fields,
+                               std::size_t size) {
+  FieldReader reader(fields, size);
+  Field field;
+  while (reader.next(field)) {
+    out.push_back(' ');
+    out.append(field.key, field.key_size);
+    out.push_back('=');
+    append_field_value(out, field, false);
+  }
+}
+
+// Appends the text form of fields to a deferred payload as one more string
+// argument, for the binary log, whose records carry no field section.
+inline void append_deferred_fields(LineBuffer &payload, const char *fields,
+                                   std::size_t size) {
+  payload.push_back(deferred_string);
+  std::size_t length_at = payload.size();
+  payload.append("\0\0\0\0", sizeof(std::uint32_t));
+  append_text_fields(payload, fields, size);
+  std::uint32_t length = static_cast<std::uint32_t>(
+      payload.size() - length_at - sizeof(length));
+  std::memcpy(payload.data() + length_at, &length, sizeof(length));
+}
+
+// {"time":"...","level":"info","category":"NET","msg":"...","key":value}
+// without the newline; the category is left out when there is none.
+inline void append_json_record(LineBuffer &out, const Record &record,
+                               UtcTimestampCache &timestamps) {
+  const std::string &category = Categories::instance().get(record.category).name;
+  out.append("{\"time\":\"", 9);
+  out.commit(timestamps.format(out.reserve(UtcTimestampCache::max_size),
+                               record.timestamp));
+  out.append("\",\"level\":\"", 11);
+  out.append(level_name(record.level));
+  out.push_back('"');
+  if (!category.empty()) {
+    out.append(",\"category\":", 12);
+    append_json_string(out, category.data(), category.size());
+  }
+  out.append(",\"msg\":", 7);
+  append_json_string(out, record.message, record.size);
+  FieldReader reader(record.fields, record.fields_size);
+  Field field;
+  while (reader.next(field)) {
+    out.push_back(',');
+    append_json_string(out, field.key, field.key_size);
+    out.push_back(':');
+    append_field_value(out, field, true);
+  }
+  out.push_back('}');
+}
+
+// time=... level=info category=NET msg=... key=value, without the newline.
+inline void append_logfmt_record(LineBuffer &out, const Record &record,
+                                 UtcTimestampCache &timestamps) {
+  const std::string &category = Categories::instance().get(record.category).name;
+  out.append("time=", 5);
+  out.commit(timestamps.format(out.reserve(UtcTimestampCache::max_size),
+                               record.timestamp));
+  out.append(" level=", 7);
+  out.append(level_name(record.level));
+  if (!category.empty()) {
+    out.append(" category=", 10);
+    append_logfmt_string(out, category.data(), category.size());
+  }
+  out.append(" msg=", 5);
+  append_logfmt_string(out, record.message, record.size);
+  append_text_fields(out, record.fields, record.fields_size);
+}
+
+} // namespace detail
+
+// Destination for records, with its own minimum level. write() and flush()
+// are called by one thread at a time: the writer thread in asynchronous mode,
+// otherwise the logging thread under the sink list's lock. Sinks must not log.
+class Sink {
+public:
+  explicit Sink(Level level = Level::Trace)
+      : m_level(detail::severity(level)),
+        m_encoding(static_cast<int>(Encoding::Text)) {}
+  virtual ~Sink() {}
+
+  void set_level(Level level);
+
+  bool accepts(Level level) const {
+    return detail::severity(level) >= m_level.load(std::memory_order_relaxed);
+  }
+
+  // Selects how format() renders records; Encoding::Text by default.
+  void set_encoding(Encoding encoding) {
+    m_encoding.store(static_cast<int>(encoding), std::memory_order_relaxed);
+  }
+
+  virtual void write(const Record &record) = 0;
+
+  // Writes out everything buffered. Called after every synchronous record,
+  // when the writer thread stops and by log::flush().
+  virtual void flush() {}
+
+  // Called by the writer thread after each pass over the thread buffers, so
+  // a sink may keep collecting output across passes.
+  virtual void end_batch() { flush(); }
+
+protected:
+  // Appends the record in the sink's Encoding, without the newline. Only
+  // Encoding::Text is colored.
+  void format(detail::LineBuffer &out, const Record &record, bool colored) {
+    switch (static_cast<Encoding>(m_encoding.load(std::memory_order_relaxed))) {
+    case Encoding::Json:
+      detail::append_json_record(out, record, m_utc_timestamps);
+      return;
+    case Encoding::Logfmt:
+      detail::append_logfmt_record(out, record, m_utc_timestamps);
+      return;
+    case Encoding::Text:
+      break;
+    }
+    const std::string &category =
+        detail::Categories::instance().get(record.category).name;
+    detail::append_timestamp(out, m_timestamps, record.timestamp);
+    detail::append_prefix(out, record.level, category.data(), category.size(),
+                          colored);
+    out.append(record.message, record.size);
+    detail::append_text_fields(out, record.fields, record.fields_size);
+    if (colored)
+      out.append("\033[0m");
+  }
+
+private:
+  std::atomic<int> m_level;
+  std::atomic<int> m_encoding;
+  detail::TimestampCache m_timestamps;
+  detail::UtcTimestampCache m_utc_timestamps;
+};
+
+// Colored lines on std::clog; the only sink until others are added.
+class ConsoleSink : public Sink {
+public:
+  explicit ConsoleSink(Level level = Level::Trace, bool colored = true)
+      : Sink(level), m_colored(colored) {}
+
+  void write(const Record &record) {
+    format(m_buffer, record, m_colored);
+    m_buffer.push_back('\n');
+  }
+
+  void flush() {
+    std::clog.write(m_buffer.data(),
+                    static_cast<std::streamsize>(m_buffer.size()));
+    std::clog.flush();
+    m_buffer.clear();
+  }
+
+private:
+  bool m_colored;
+  detail::LineBuffer m_buffer;
+};
+
+// How much output a FileSink holds back. Lines are collected in chunks of
+// chunk_size bytes that go out in one writev(2) once max_bytes are pending,
+// or at the end of a writer pass once the oldest line is max_delay old (zero:
+// at the end of every pass).
+struct FileBuffering {
+  std::size_t chunk_size;
+  std::size_t max_bytes;
+  std::chrono::milliseconds max_delay;
+
+  FileBuffering()
+      : chunk_size(64 * 1024), max_bytes(1024 * 1024), max_delay(0) {}
+};
+
+namespace detail {
+
+// Writes every byte described by iov, resubmitting after short writes.
+inline bool write_all(int fd, struct iovec *iov, std::size_t count) {
+  while (count != 0) {
+    ssize_t written =
+        ::writev(fd, iov, static_cast<int>(std::min<std::size_t>(count, IOV_MAX)));
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    std::size_t left = static_cast<std::size_t>(written);
+    for (; count != 0 && left >= iov->iov_len; ++iov, --count)
+      left -= iov->iov_len;
+    if (left != 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+      iov->iov_len -= left;
+    }
+  }
+  return true;
+}
+
+} // namespace detail
+
+// Plain lines appended to a file, buffered as described by FileBuffering.
+class FileSink : public Sink {
+public:
+  explicit FileSink(const std::string &path, Level level = Level::Trace,
+                    const FileBuffering &buffering = FileBuffering())
+      : Sink(level), m_path(path), m_fd(-1), m_size(0), m_buffering(buffering),
+        m_current(0), m_pending(0), m_oldest(0) {
+    open(false);
+  }
+
+  ~FileSink() {
+    flush();
+    close();
+  }
+
+  bool is_open() const { return m_fd >= 0; }
+
+  void write(const Record &record) {
+    if (m_current == m_chunks.size())
+      m_chunks.push_back(
+          std::unique_ptr<detail::LineBuffer>(new detail::LineBuffer()));
+    detail::LineBuffer &chunk = *m_chunks[m_current];
+    std::size_t before = chunk.size();
+    format(chunk, record, false);
+    chunk.push_back('\n');
+    if (m_pending == 0)
+      m_oldest = record.timestamp;
+    m_pending += chunk.size() - before;
+    if (chunk.size() >= m_buffering.chunk_size)
+      ++m_current;
+    if (m_pending >= m_buffering.max_bytes)
+      flush();
+  }
+
+  void flush() {
+    if (m_pending == 0)
+      return;
+    m_iov.clear();
+    for (std::size_t i = 0; i < m_chunks.size() && m_chunks[i]->size(); ++i) {
+      struct iovec iov;
+      iov.iov_base = m_chunks[i]->data();
+      iov.iov_len = m_chunks[i]->size();
+      m_iov.push_back(iov);
+    }
+    if (m_fd >= 0 && detail::write_all(m_fd, m_iov.data(), m_iov.size()))
+      m_size += m_pending;
+    for (std::size_t i = 0; i < m_chunks.size(); ++i)
+      m_chunks[i]->clear();
+    m_current = 0;
+    m_pending = 0;
+  }
+
+  void end_batch() {
+    std::uint64_t delay = detail::to_nanoseconds(m_buffering.max_delay);
+    if (m_pending != 0 &&
+        (delay == 0 || detail::system_nanoseconds() - m_oldest >= delay))
+      flush();
+  }
+
+protected:
+  const std::string &path() const { return m_path; }
+
+  // Bytes in the file, including those still buffered.
+  std::size_t size() const { return m_size + m_pending; }
+
+  bool open(bool truncate) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : O_APPEND);
+    m_fd = ::open(m_path.c_str(), flags, 0644);
+    struct stat info;
+    if (m_fd < 0) {
+      std::clog << "log: cannot open " << m_path << '\n';
+      return false;
+    }
+    m_size = ::fstat(m_fd, &info) == 0 ? static_cast<std::size_t>(info.st_size)
+                                        : 0;
+    return true;
+  }
+
+  void close() {
+    if (m_fd >= 0)
+      ::close(m_fd);
+    m_fd = -1;
+  }
+
+private:
+  std::string m_path;
+  int m_fd;
+  std::size_t m_size;
+  FileBuffering m_buffering;
+  std::vector<std::unique_ptr<detail::LineBuffer> > m_chunks;
+  std::vector<struct iovec> m_iov;
+  std::size_t m_current;
+  std::size_t m_pending;
+  std::uint64_t m_oldest;
+};
+
+// FileSink that starts a new file once the current one reaches max_size
+// bytes or has been open for interval (zero disables either). Older files are
+// kept as path.1 (the newest) up to path.<max_files>. Rotation happens inside
+// write(), on the writer thread in asynchronous mode, so producers never wait
+// for it.
+class RotatingFileSink : public FileSink {
+public:
+  RotatingFileSink(const std::string &path, std::size_t max_size,
+                   std::size_t max_files = 5,
+                   std::chrono::seconds interval = std::chrono::seconds(0),
+                   Level level = Level::Trace,
+                   const FileBuffering &buffering = FileBuffering())
+      : FileSink(path, level, buffering), m_max_size(max_size),
+        m_max_files(max_files),
+        m_interval(detail::to_nanoseconds(interval)),
+        m_next_rotation(detail::system_nanoseconds() + m_interval) {}
+
+  void write(const Record &record) {
+    if ((m_max_size != 0 && size() >= m_max_size) ||
+        (m_interval != 0 && record.timestamp >= m_next_rotation))
+      rotate(record.timestamp);
+    FileSink::write(record);
+  }
+
+private:
+  std::string rotated(std::size_t index) const {
+    std::ostringstream name;
+    name << path() << '.' << index;
+    return name.str();
+  }
+
+  void rotate(std::uint64_t now) {
+    flush();
+    close();
+    for (std::size_t i = m_max_files; i > 1; --i)
+      std::rename(rotated(i - 1).c_str(), rotated(i).c_str());
+    if (m_max_files != 0)
+      std::rename(path().c_str(), rotated(1).c_str());
+    open(true);
+    m_next_rotation = now + m_interval;
+  }
+
+  std::size_t m_max_size;
+  std::size_t m_max_files;
+  std::uint64_t m_interval;
+  std::uint64_t m_next_rotation;
+};
+
+// Plain lines copied into a memory-mapped file, so writing a record is a
+// memcpy rather than a system call and the kernel writes pages out on its
+// own schedule. The file grows one segment at a time; each segment is
+// preallocated with posix_fallocate(3), so a full disk stops the sink instead
+// of raising SIGBUS. On close the unused end of the last segment is cut off
+// again. After a crash the file may end in zero bytes, which are trimmed when
+// it is next opened.
+class MappedFileSink : public Sink {
+public:
+  explicit MappedFileSink(const std::string &path,
+                          std::size_t segment_size = 16 * 1024 * 1024,
+                          Level level = Level::Trace)
+      : Sink(level), m_path(path), m_fd(-1), m_segment_size(segment_size),
+        m_map(0), m_offset(0), m_used(0) {
+    std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    m_segment_size = std::max(page, (m_segment_size + page - 1) / page * page);
+    open();
+  }
+
+  ~MappedFileSink() { close(); }
+
+  bool is_open() const { return m_map != 0; }
+
+  void write(const Record &record) {
+    m_line.clear();
+    format(m_line, record, false);
+    m_line.push_back('\n');
+    const char *data = m_line.data();
+    std::size_t left = m_line.size();
+    while (left != 0 && m_map != 0) {
+      if (m_used == m_segment_size) {
+        if (!map(m_offset + m_segment_size))
+          return;
+        m_used = 0;
+      }
+      std::size_t count = std::min(left, m_segment_size - m_used);
+      std::memcpy(m_map + m_used, data, count);
+      m_used += count;
+      data += count;
+      left -= count;
+    }
+  }
+
+  // Nothing to do: mapped pages are already in the page cache, where other
+  // readers see them and where they survive a crash of this process.
+  void flush() {}
+
+private:
+  void open() {
+    m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat info;
+    if (m_fd >= 0 && ::fstat(m_fd, &info) != 0) {
+      ::close(m_fd);
+      m_fd = -1;
+    }
+    if (m_fd < 0) {
+      std::clog << "log: cannot open " << m_path << '\n';
+      return;
+    }
+    std::size_t size = static_cast<std::size_t>(info.st_size);
+    m_offset = size - size % m_segment_size;
+    m_used = size % m_segment_size;
+    if (m_used == 0 && m_offset != 0) {
+      m_offset -= m_segment_size; // reopen a full last segment to trim it
+      m_used = m_segment_size;
+    }
+    if (!map(m_offset))
+      return;
+    while (m_used != 0 && m_map[m_used - 1] == '\0')
+      --m_used;
+  }
+
+  // Maps the segment starting at offset, allocating it in the file first.
+  bool map(std::size_t offset) {
+    if (m_map != 0)
+      ::munmap(m_map, m_segment_size);
+    m_map = 0;
+    void *map = MAP_FAILED;
+    if (::posix_fallocate(m_fd, static_cast<off_t>(offset),
+                          static_cast<off_t>(m_segment_size)) == 0)
+      map = ::mmap(0, m_segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd,
+                   static_cast<off_t>(offset));
+    if (map == MAP_FAILED) {
+      std::clog << "log: cannot map " << m_path << '\n';
+      return false;
+    }
+    m_map = static_cast<char *>(map);
+    m_offset = offset;
+    return true;
+  }
+
+  // Cuts the file back to the bytes actually written.
+  void close() {
+    if (m_map != 0)
+      ::munmap(m_map, m_segment_size);
+    if (m_fd >= 0) {
+      if (::ftruncate(m_fd, static_cast<off_t>(m_offset + m_used)) != 0)
+        std::clog << "log: cannot truncate " << m_path << '\n';
+      ::close(m_fd);
+    }
+    m_map = 0;
+    m_fd = -1;
+  }
+
+  std::string m_path;
+  int m_fd;
+  std::size_t m_segment_size;
+  char *m_map;
+  std::size_t m_offset; // of the mapped segment in the file
+  std::size_t m_used;   // bytes written to the mapped segment
+  detail::LineBuffer m_line;
+};
+
+// Records sent to syslog(3), which journald also collects on systemd hosts.
+// Only [CATEGORY] and the message are sent; the daemon adds its own time.
+class SyslogSink : public Sink {
+public:
+  explicit SyslogSink(const std::string &ident = std::string(),
+                      int facility = LOG_USER, Level level = Level::Trace)
+      : Sink(level), m_ident(ident) {
+    ::openlog(m_ident.empty() ? 0 : m_ident.c_str(), LOG_PID, facility);
+  }
+
+  ~SyslogSink() { ::closelog(); }
+
+  void write(const Record &record) {
+    const std::string &category =
+        detail::Categories::instance().get(record.category).name;
+    m_buffer.clear();
+    if (!category.empty()) {
+      m_buffer.push_back('[');
+      m_buffer.append(category.data(), category.size());
+      m_buffer.append("] ");
+    }
+    m_buffer.append(record.message, record.size);
+    detail::append_text_fields(m_buffer, record.fields, record.fields_size);
+    ::syslog(priority(record.level), "%.*s",
+             static_cast<int>(m_buffer.size()), m_buffer.data());
+  }
+
+private:
+  static int priority(Level level) {
+    switch (level) {
+    case Level::Info:      return LOG_INFO;
+    case Level::Notice:    return LOG_NOTICE;
+    case Level::Warning:   return LOG_WARNING;
+    case Level::Error:     return LOG_ERR;
+    case Level::Critical:  return LOG_CRIT;
+    case Level::Alert:     return LOG_ALERT;
+    case Level::Emergency: return LOG_EMERG;
+    default:               return LOG_DEBUG;
+    }
+  }
+
+  std::string m_ident;
+  detail::LineBuffer m_buffer;
+};
+
+namespace detail {
+
+template <typename T> bool &thread_exited() {
+  static thread_local bool exited = false;
+  return exited;
+}
+
+template <typename T> struct ThreadOwner {
+  ThreadOwner() : value(new T()) {}
+  ~ThreadOwner() {
+    thread_exited<T>() = true;
+    delete value;
+  }
+
+  T *value;
+};
+
+// The calling thread's T. A statement that runs after the thread's
+// thread_local destructors, as those in static destructors after main() do,
+// gets a new T that is never freed instead of the destroyed one.
+template <typename T> T &thread_instance() {
+  if (thread_exited<T>()) {
+    static thread_local T *late = 0;
+    if (!late)
+      late = new T();
+    return *late;
+  }
+  static thread_local ThreadOwner<T> owner;
+  return *owner.value;
+}
+
+class LineStreamBuf : public std::streambuf {
+public:
+  explicit LineStreamBuf(LineBuffer &line) : m_line(line) {}
+
+protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+      m_line.push_back(traits_type::to_char_type(c));
+    return traits_type::not_eof(c);
+  }
+
+  std::streamsize xsputn(const char *data, std::streamsize size) override {
+    m_line.append(data, static_cast<std::size_t>(size));
+    return size;
+  }
+
+private:
+  LineBuffer &m_line;
+};
+
+// A line being built, with an ostream over it for types that have no fast
+// path in Logger.
+struct LineSlot {
+  LineSlot() : buf(line), stream(&buf) {}
+
+  LineBuffer line;
+  LineBuffer fields; // Logger::kv(), appended to line at the end
+  LineStreamBuf buf;
+  std::ostream stream;
+};
+
+// Per-thread stack of reusable lines; nested Loggers (a log statement whose
+// arguments log themselves) each get their own slot.
+struct LinePool {
+  LinePool() : depth(0) {}
+
+  std::vector<std::unique_ptr<LineSlot> > slots;
+  std::size_t depth;
+};
+
+inline LinePool &line_pool() { return thread_instance<LinePool>(); }
+
+inline LineSlot &acquire_line() {
+  LinePool &pool = line_pool();
+  if (pool.depth == pool.slots.size())
+    pool.slots.push_back(std::unique_ptr<LineSlot>(new LineSlot));
+  LineSlot &slot = *pool.slots[pool.depth++];
+  slot.line.clear();
+  slot.fields.clear();
+  slot.stream.clear();
+  slot.stream.flags(std::ios_base::dec | std::ios_base::skipws);
+  slot.stream.precision(6);
+  slot.stream.fill(' ');
+  slot.stream.width(0);
+  return slot;
+}
+
+inline void release_line() { --line_pool().depth; }
+
+// Fields added to every record of a thread by set_thread_name() and
+// log::Context, encoded once when they are set: the thread name first, then
+// the open Contexts from the outermost in.
+struct ThreadContext {
+  ThreadContext() : name_size(0) {}
+
+  LineBuffer fields;
+  std::size_t name_size;
+};
+
+inline ThreadContext &thread_context() {
+  return thread_instance<ThreadContext>();
+}
+
+// Ends the payload of a record with its field section: the thread's context
+// and then the statement's own fields.
+inline void end_fields(RecordHeader &header, LineBuffer &line,
+                       const LineBuffer &fields) {
+  const LineBuffer &context = thread_context().fields;
+  std::size_t size = context.size() + fields.size();
+  if (size == 0)
+    return;
+  std::uint32_t section = static_cast<std::uint32_t>(size);
+  line.append(context.data(), context.size());
+  line.append(fields.data(), fields.size());
+  line.append(reinterpret_cast<const char *>(&section), sizeof(section));
+  header.flags |= record_fields;
+}
+
+// Set while the writer thread runs with ClockSource::Steady: records are then
+// stamped with steady_clock and converted when they are formatted.
+inline std::atomic<bool> &steady_stamps() {
+  static std::atomic<bool> steady(false);
+  return steady;
+}
+
+// Sets the timestamp of a record being built, flagging it when it is
+// steady_clock based.
+inline void stamp(RecordHeader &header) {
+  if (steady_stamps().load(std::memory_order_acquire)) {
+    header.flags |= record_steady_clock;
+    header.timestamp = steady_nanoseconds();
+  } else {
+    header.timestamp = system_nanoseconds();
+  }
+}
+
+// Whether a record of the level is written anywhere; log::lazy() arguments
+// are only evaluated then.
+LOG_API bool reaches_sink(Level level);
+
+// Routes a finished record: below the sink level of its category into the
+// backtrace, otherwise to the sinks, after the backtrace on Error and above.
+LOG_API void submit(const RecordHeader &header, const LineBuffer &line);
+
+// Logs a finished message with the thread's context fields, as a Logger
+// streaming it would. For the lines the logger writes itself.
+inline void emit(Level level, std::uint16_t category, const std::string &text) {
+  LineSlot &slot = acquire_line();
+  RecordHeader header;
+  header.flags = 0;
+  header.level = static_cast<std::uint8_t>(level);
+  header.category = category;
+  header.site = 0;
+  stamp(header);
+  slot.line.append(text.data(), text.size());
+  end_fields(header, slot.line, slot.fields);
+  submit(header, slot.line);
+  release_line();
+}
+
+} // namespace detail
+
+// Adds thread=name to every record the calling thread logs from now on,
+// replacing its previous name; an empty name removes it.
+inline void set_thread_name(const std::string &name) {
+  detail::ThreadContext &context = detail::thread_context();
+  detail::LineBuffer scoped;
+  scoped.append(context.fields.data() + context.name_size,
+                context.fields.size() - context.name_size);
+  context.fields.clear();
+  if (!name.empty())
+    detail::append_field(context.fields, "thread", name.data(), name.size());
+  context.name_size = context.fields.size();
+  context.fields.append(scoped.data(), scoped.size());
+}
+
+namespace detail {
+
+// State of one rate-limited or sampled call site. The statements it holds back
+// are only counted; before the next one it lets through, and at most once a
+// second, it logs how many at that statement's level and category.
+class LimitSite {
+public:
+  LimitSite(const char *file, int line)
+      : m_file(file), m_line(line), m_next(0), m_seen(0), m_suppressed(0),
+        m_reported(0) {}
+
+  // A token bucket holding per_second statements and refilled at that rate,
+  // kept as the time at which it is next full (GCRA), so one CAS updates it.
+  bool limit(unsigned per_second, Level level, std::uint16_t category) {
+    if (per_second == 0)
+      return suppress();
+    std::uint64_t now = steady_nanoseconds();
+    std::uint64_t interval = 1000000000ULL / per_second;
+    std::uint64_t next = m_next.load(std::memory_order_relaxed);
+    for (;;) {
+      std::uint64_t full = std::max(next, now);
+      if (full - now > 1000000000ULL - interval)
+        return suppress();
+      if (m_next.compare_exchange_weak(next, full + interval,
+                                       std::memory_order_relaxed))
+        break;
+    }
+    report(level, category);
+    return true;
+  }
+
+  // Lets through the first statement of every n.
+  bool sample(unsigned n, Level level, std::uint16_t category) {
+    if (n > 1 && m_seen.fetch_add(1, std::memory_order_relaxed) % n != 0)
+      return suppress();
+    report(level, category);
+    return true;
+  }
+
+private:
+  bool suppress() {
+    m_suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  void report(Level level, std::uint16_t category) {
+    if (m_suppressed.load(std::memory_order_relaxed) == 0)
+      return;
+    std::uint64_t now = steady_nanoseconds();
+    std::uint64_t reported = m_reported.load(std::memory_order_relaxed);
+    if ((reported != 0 && now - reported < 1000000000ULL) ||
+        !m_reported.compare_exchange_strong(reported, now,
+                                            std::memory_order_relaxed))
+      return;
+    std::uint64_t count = m_suppressed.exchange(0, std::memory_order_relaxed);
+    if (count == 0)
+      return;
+    std::ostringstream oss;
+    oss << "suppressed " << count << " messages @ " << m_file << ":" << m_line;
+    emit(level, category, oss.str());
+  }
+
+  const char *m_file;
+  int m_line;
+  std::atomic<std::uint64_t> m_next; // steady nanoseconds
+  std::atomic<std::uint64_t> m_seen;
+  std::atomic<std::uint64_t> m_suppressed;
+  std::atomic<std::uint64_t> m_reported; // steady nanoseconds, zero: never
+};
+
+// Clock behind ScopeLogger, in nanoseconds on the steady_clock scale. With
+// ProfileClock::Tsc it reads the CPU's time-stamp counter (rdtsc on x86,
+// cntvct_el0 on AArch64) and converts the ticks with a factor measured once
+// against steady_clock, which costs a few nanoseconds instead of a
+// clock_gettime() call. Leaked on purpose, like Categories.
+class ProfileTimer {
+public:
+  static ProfileTimer &instance() {
+    static ProfileTimer *timer = new ProfileTimer();
+    return *timer;
+  }
+
+  std::uint64_t now() const {
+    if (!m_tsc.load(std::memory_order_acquire))
+      return steady_nanoseconds();
+    return m_steady_base +
+           static_cast<std::uint64_t>(
+               static_cast<double>(ticks() - m_tick_base) * m_ns_per_tick);
+  }
+
+  // Returns false, staying on steady_clock, when there is no counter that
+  // ticks at a constant rate.
+  bool set(ProfileClock clock) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (clock == ProfileClock::Tsc && !m_calibrated) {
+      if (!invariant())
+        return false;
+      calibrate();
+      m_calibrated = true;
+    }
+    m_tsc.store(clock == ProfileClock::Tsc, std::memory_order_release);
+    return true;
+  }
+
+private:
+  ProfileTimer()
+      : m_tsc(false), m_calibrated(false), m_ns_per_tick(0), m_tick_base(0),
+        m_steady_base(0) {}
+
+  static std::uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    std::uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return steady_nanoseconds();
+#endif
+  }
+
+  // The TSC may change rate with the CPU frequency or stop in deep sleep
+  // unless CPUID reports it invariant. The AArch64 generic timer is always
+  // constant-rate.
+  static bool invariant() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) &&
+           (edx & (1u << 8)) != 0;
+#elif defined(__aarch64__)
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void calibrate() {
+#if defined(__aarch64__)
+    std::uint64_t frequency;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+    m_ns_per_tick = 1e9 / static_cast<double>(frequency);
+    m_tick_base = ticks();
+    m_steady_base = steady_nanoseconds();
+#else
+    std::uint64_t steady_start = steady_nanoseconds();
+    std::uint64_t tick_start = ticks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::uint64_t steady_end = steady_nanoseconds();
+    std::uint64_t tick_end = ticks();
+    m_ns_per_tick = static_cast<double>(steady_end - steady_start) /
+                    static_cast<double>(tick_end - tick_start);
+    m_tick_base = tick_end;
+    m_steady_base = steady_end;
+#endif
+  }
+
+  std::mutex m_mutex;
+  std::atomic<bool> m_tsc;
+  bool m_calibrated;
+  // Written before m_tsc is first set and never again.
+  double m_ns_per_tick;
+  std::uint64_t m_tick_base;
+  std::uint64_t m_steady_base;
+};
+
+// Nesting below which scopes only count in the flat statistics, see
+// Profiler::enter().
+enum : std::size_t { profile_max_depth = 64 };
+
+// A log_profile() call site. Sites register themselves once and are then
+// identified by index in the Profiler's tables.
+struct ProfileSite {
+  ProfileSite(const char *tag, const char *file, int line);
+
+  const char *tag;
+  const char *file;
+  int line;
+  std::size_t id;
+};
+
+// Nesting depth of the open Lines-mode scopes of this thread.
+inline std::size_t &scope_depth() {
+  static thread_local std::size_t depth = 0;
+  return depth;
+}
+
+// Two spaces per nesting level for the START and FINISH lines, as a suffix of
+// a static string so that no line allocates. Indentation stops growing at
+// profile_max_depth, like the call tree.
+inline const char *scope_indent(std::size_t depth) {
+  struct Spaces {
+    char text[2 * profile_max_depth + 1];
+    Spaces() {
+      std::memset(text, ' ', sizeof(text) - 1);
+      text[sizeof(text) - 1] = '\0';
+    }
+  };
+  static const Spaces spaces;
+  std::size_t width = 2 * std::min<std::size_t>(depth, profile_max_depth);
+  return spaces.text + sizeof(spaces.text) - 1 - width;
+}
+
+struct ScopeNode;
+
+// What a log_profile() scope reports to the Profiler and to the TraceWriter of
+// start_trace(), see ScopeLogger.
+LOG_API bool profile_aggregating();
+LOG_API ScopeNode *profile_enter(const ProfileSite &site);
+LOG_API void profile_record(const ProfileSite &site, ScopeNode *node,
+                            std::uint64_t duration, std::uint64_t now);
+LOG_API bool trace_active();
+LOG_API void trace_add(const ProfileSite &site, std::uint64_t start,
+                       std::uint64_t duration);
+
+} // namespace detail
+
+// Switches Logger to the background writer. Records are written in batches
+// from a dedicated thread until shutdown() is called, or until exit(), which
+// drains the buffers first.
+LOG_API void start_async(const AsyncOptions &options = AsyncOptions());
+
+inline void set_timestamp_precision(TimestampPrecision precision) {
+  detail::timestamp_precision().store(precision, std::memory_order_relaxed);
+}
+
+// Blocks until every record queued so far has been written.
+LOG_API void flush();
+
+// Adds a destination for records; a ConsoleSink is installed by default.
+LOG_API void add_sink(const std::shared_ptr<Sink> &sink);
+
+// Records queued before the call still reach the removed sink.
+LOG_API void remove_sink(const std::shared_ptr<Sink> &sink);
+
+// Removes every sink, including the default console one.
+LOG_API void clear_sinks();
+
+// Drains the buffers, stops the writer thread and returns to synchronous mode.
+LOG_API void shutdown();
+
+// Installs handlers for SIGSEGV, SIGABRT and SIGBUS that write the records
+// still queued for the writer thread straight to fd, then pass the signal on
+// to the previous handler. Lines that sinks already hold are not recovered,
+// so leave FileBuffering::max_delay at zero when this matters. The handler
+// runs on an alternate signal stack, set up for the calling thread and for
+// threads that log their first record later.
+LOG_API void install_crash_handler(int fd = STDERR_FILENO);
+
+// Renders a binary log written with AsyncOptions::binary_file as text.
+// Returns false when the input is not a binary log or is cut short.
+LOG_API bool decode_binary(std::istream &in, std::ostream &out);
+
+// Lines: every profiled scope logs START and FINISH lines.
+// Aggregate: scopes only add their duration to per-site statistics, printed
+// by profile_summary() and, with a non-zero interval, periodically by
+// whichever thread finishes a scope once the interval is up.
+LOG_API void set_profile_mode(ProfileMode mode,
+                              std::chrono::milliseconds interval =
+                                  std::chrono::milliseconds(0));
+
+// Logs the statistics gathered in ProfileMode::Aggregate, one Profile record
+// per call site, the sites with the most total time first.
+LOG_API void profile_summary();
+
+// Logs the call tree gathered in ProfileMode::Aggregate: one Profile record
+// per chain of nested scopes, indented by depth, with the time spent inside
+// the scope (inclusive) and outside its profiled children (exclusive).
+LOG_API void profile_tree();
+
+// The logger's own counters, added up over threads: records emitted, dropped
+// and their bytes per level and per category, the fullest a thread's buffer
+// has been, and in asynchronous mode the records per write and the time per
+// pass of the writer thread.
+LOG_API Stats stats();
+
+// Logs stats() as Profile records.
+LOG_API void stats_summary();
+
+// Logs stats() every interval, from whichever thread logs once it is up;
+// zero stops it.
+LOG_API void set_stats_interval(std::chrono::milliseconds interval);
+
+// Keeps the records from `level` up that the runtime level filters out in a
+// ring of `bytes` per thread, and writes them out ahead of that thread's next
+// Error or higher record. The statements are evaluated as if enabled.
+LOG_API void enable_backtrace(Level level, std::size_t bytes = 64 * 1024);
+
+// Stops keeping records and forgets the ones kept so far.
+LOG_API void disable_backtrace();
+
+// Writes out the records kept by the calling thread now.
+LOG_API void dump_backtrace();
+
+// Times log_profile() scopes with the CPU's time-stamp counter instead of
+// steady_clock. The first switch to ProfileClock::Tsc calibrates the counter
+// for 20 ms. Returns false and keeps steady_clock when the counter is not
+// invariant or the architecture has none.
+inline bool set_profile_clock(ProfileClock clock) {
+  return detail::ProfileTimer::instance().set(clock);
+}
+
+// Writes every log_profile() scope that ends from now on as a complete event
+// to a Chrome Trace Event JSON file at path, which chrome://tracing and
+// ui.perfetto.dev open. Works in either ProfileMode. Returns false when the
+// file cannot be opened or a trace is already being written.
+LOG_API bool start_trace(const std::string &path);
+
+// Writes the events the threads still buffer and completes the trace file.
+LOG_API void stop_trace();
+
+} // namespace log
+
+#ifndef LOG_COMPILED_LIB
+#include "logger_backend.hpp"
+#endif
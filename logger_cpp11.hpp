@@ -1,5 +1,5 @@
 /*
- * logger.hpp
+ * logger_cpp11.hpp
  * Copyright (c) 2025 João Pedro Foscarini
  * SPDX-License-Identifier: MIT
  *
@@ -10,141 +10,574 @@
 
 #pragma once
 
-#include <chrono>
-#include <cstring>
-#include <iomanip>
-#include <iostream>
-#include <sstream>
-#include <string>
+// C++11 front-end: stream-style log statements over logger_core.hpp, with
+// __FILE__ and __LINE__ for the call sites.
+
+#include "logger_core.hpp"
 
 namespace log {
+namespace detail {
+
+// Runs a log::deferred() callable from its bytes in a record and streams the
+// result.
+template <typename F>
+void call_deferred(const char *closure, LineBuffer &out) {
+  typename std::aligned_storage<sizeof(F), alignof(F)>::type storage;
+  std::memcpy(&storage, closure, sizeof(F));
+  LineStreamBuf buf(out);
+  std::ostream stream(&buf);
+  stream << (*reinterpret_cast<const F *>(&storage))();
+}
+
+} // namespace detail
+
+// A callable streamed in place of its result, which is only computed when the
+// record can reach a sink:
+//
+//   log_debug() << "state " << log::lazy([&]() { return dump(state); });
+template <typename F> struct Lazy { F call; };
+
+template <typename F> Lazy<F> lazy(F call) {
+  Lazy<F> value = {call};
+  return value;
+}
 
-enum class Level { Trace, Debug, Info, Notice, Warning, Error, Critical, Alert, Emergency, Profile };
+// lazy() whose call runs where the record is formatted, normally on the
+// writer thread, when streamed into a log_deferred_*() statement; elsewhere it
+// is a lazy(). The callable is copied bitwise into the record, so everything
+// it refers to must outlive the record: capture by value. It must not log.
+template <typename F> struct DeferredLazy { F call; };
+
+template <typename F> DeferredLazy<F> deferred(F call) {
+  static_assert(std::is_trivially_copyable<F>::value,
+                "log::deferred() needs a trivially copyable callable");
+  DeferredLazy<F> value = {call};
+  return value;
+}
 
 class Logger {
 public:
-  explicit Logger(Level level, const std::string &category = {}) : m_stream() {
-    m_stream << "[" << timestamp() << "][" << colorCode(level)
-             << levelLabel(level) << "\033[0m]";
-    if (!category.empty())
-      m_stream << "[" << category << "]";
-    m_stream << " ";
+  // category is an id from detail::Categories, 0 being uncategorized; site
+  // is the statement's, which the log macros pass.
+  explicit Logger(Level level, std::uint16_t category = 0,
+                  const detail::CallSite *site = 0)
+      : m_slot(detail::acquire_line()), m_line(m_slot.line) {
+    start(level, category, site);
+  }
+
+  Logger(Level level, const std::string &category)
+      : m_slot(detail::acquire_line()), m_line(m_slot.line) {
+    start(level, detail::Categories::instance().intern(category).id, 0);
   }
 
   ~Logger() {
-    m_stream << "\033[0m";
-    std::clog << m_stream.str() << '\n';
+    detail::end_fields(m_header, m_line, m_slot.fields);
+    detail::submit(m_header, m_line);
+    detail::release_line();
   }
 
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
   template <typename T> Logger &operator<<(const T &value) {
-    m_stream << value;
+    m_slot.stream << value;
     return *this;
   }
 
-private:
-  std::ostringstream m_stream;
-
-  std::string timestamp() const {
-    using namespace std::chrono;
-    auto now = system_clock::now();
-    auto ms = duration_cast<milliseconds>(now.time_since_epoch()) % 1000;
-    auto itt = system_clock::to_time_t(now);
-    std::tm tm;
-#if defined(_WIN32)
-    localtime_s(&tm, &itt);
-#else
-    localtime_r(&itt, &tm);
-#endif
-    std::ostringstream oss;
-    oss << std::put_time(&tm, "%T") << "." << std::setw(3) << std::setfill('0')
-        << ms.count();
-    return oss.str();
-  }
-
-  static const char *colorCode(Level level) {
-    switch (level) {
-    case Level::Trace: return "\033[1;37m";
-    case Level::Debug: return "\033[1;34m";
-    case Level::Info: return "\033[1;32m";
-    case Level::Notice: return "\033[1;36m";
-    case Level::Warning: return "\033[1;33m";
-    case Level::Error: return "\033[1;31m";
-    case Level::Critical: return "\033[1;35m";
-    case Level::Alert: return "\033[1;41m";
-    case Level::Emergency: return "\033[1;41;97m";
-    case Level::Profile: return "\033[1;36m";
-    default: return "\033[0m";
+  Logger &operator<<(const char *value) {
+    if (!value)
+      value = detail::null_string;
+    if (plain())
+      m_line.append(value);
+    else
+      m_slot.stream << value;
+    return *this;
+  }
+
+  Logger &operator<<(char *value) {
+    return *this << static_cast<const char *>(value);
+  }
+
+  Logger &operator<<(const std::string &value) {
+    if (plain())
+      m_line.append(value.data(), value.size());
+    else
+      m_slot.stream << value;
+    return *this;
+  }
+
+  Logger &operator<<(char value) {
+    if (plain())
+      m_line.push_back(value);
+    else
+      m_slot.stream << value;
+    return *this;
+  }
+
+  Logger &operator<<(int value) { return integer(value); }
+  Logger &operator<<(long value) { return integer(value); }
+  Logger &operator<<(long long value) { return integer(value); }
+  Logger &operator<<(unsigned value) { return integer(value); }
+  Logger &operator<<(unsigned long value) { return integer(value); }
+  Logger &operator<<(unsigned long long value) { return integer(value); }
+
+  Logger &operator<<(double value) {
+    if (plain()) {
+      char *out = m_line.reserve(32);
+      int written = std::snprintf(out, 32, "%.*g",
+                                  static_cast<int>(m_slot.stream.precision()),
+                                  value);
+      if (written > 0 && written < 32) {
+        m_line.commit(static_cast<std::size_t>(written));
+        return *this;
+      }
     }
+    m_slot.stream << value;
+    return *this;
+  }
+
+  template <typename F> Logger &operator<<(const Lazy<F> &value) {
+    if (detail::reaches_sink(static_cast<Level>(m_header.level)))
+      *this << value.call();
+    return *this;
+  }
+
+  template <typename F> Logger &operator<<(const DeferredLazy<F> &value) {
+    return *this << lazy(value.call);
+  }
+
+  // Structured fields, kept apart from the message: sinks with
+  // Encoding::Json write them as JSON members, the others as key=value.
+  // Keys are cut at 255 bytes.
+  Logger &kv(const char *key, const char *value) {
+    detail::append_field(m_slot.fields, key, value, std::strlen(value));
+    return *this;
+  }
+
+  Logger &kv(const char *key, const std::string &value) {
+    detail::append_field(m_slot.fields, key, value.data(), value.size());
+    return *this;
+  }
+
+  Logger &kv(const char *key, bool value) {
+    detail::append_field(m_slot.fields, detail::field_bool, key, value);
+    return *this;
+  }
+
+  Logger &kv(const char *key, int value) { return signed_field(key, value); }
+  Logger &kv(const char *key, long value) { return signed_field(key, value); }
+  Logger &kv(const char *key, long long value) {
+    return signed_field(key, value);
+  }
+  Logger &kv(const char *key, unsigned value) {
+    return unsigned_field(key, value);
+  }
+  Logger &kv(const char *key, unsigned long value) {
+    return unsigned_field(key, value);
+  }
+  Logger &kv(const char *key, unsigned long long value) {
+    return unsigned_field(key, value);
+  }
+
+  Logger &kv(const char *key, double value) {
+    detail::append_field(m_slot.fields, detail::field_double, key, value);
+    return *this;
+  }
+
+private:
+  detail::LineSlot &m_slot;
+  detail::LineBuffer &m_line;
+  detail::RecordHeader m_header;
+
+  void start(Level level, std::uint16_t category,
+             const detail::CallSite *site) {
+    m_header.flags = 0;
+    m_header.level = static_cast<std::uint8_t>(level);
+    m_header.category = category;
+    m_header.site = site;
+    detail::stamp(m_header);
+  }
+
+  // True while no manipulator has changed the stream's formatting state.
+  bool plain() const {
+    return m_slot.stream.flags() ==
+               (std::ios_base::dec | std::ios_base::skipws) &&
+           m_slot.stream.width() == 0;
+  }
+
+  template <typename T> Logger &integer(T value) {
+    if (!plain())
+      m_slot.stream << value;
+    else if (value < 0)
+      detail::append_signed(m_line, static_cast<long long>(value));
+    else
+      detail::append_unsigned(m_line, static_cast<unsigned long long>(value));
+    return *this;
+  }
+
+  Logger &signed_field(const char *key, long long value) {
+    detail::append_field(m_slot.fields, detail::field_signed, key, value);
+    return *this;
+  }
+
+  Logger &unsigned_field(const char *key, unsigned long long value) {
+    detail::append_field(m_slot.fields, detail::field_unsigned, key, value);
+    return *this;
+  }
+};
+
+// Logger variant for hot paths: operator<< only copies the argument values
+// into the record and the text is produced on the writer thread (or in the
+// destructor when the writer is not running). Types without a binary
+// encoding are formatted immediately. Of a const char array in the
+// executable's read-only data, a string literal, only the address is
+// recorded; other arrays are copied, see detail::StaticText.
+class DeferredLogger {
+public:
+  explicit DeferredLogger(const detail::DeferredSite &site,
+                          const detail::CallSite *call = 0)
+      : m_slot(detail::acquire_line()), m_line(m_slot.line) {
+    m_header.flags = detail::record_deferred;
+    m_header.level = static_cast<std::uint8_t>(site.level);
+    m_header.category = site.category;
+    m_header.site = call;
+    detail::stamp(m_header);
+    raw(&site);
+  }
+
+  ~DeferredLogger() {
+    detail::end_fields(m_header, m_line, m_slot.fields);
+    detail::submit(m_header, m_line);
+    detail::release_line();
+  }
+
+  DeferredLogger(const DeferredLogger &) = delete;
+  DeferredLogger &operator=(const DeferredLogger &) = delete;
+
+  template <typename T> DeferredLogger &operator<<(const T &value) {
+    m_line.push_back(detail::deferred_string);
+    std::size_t length_at = m_line.size();
+    raw(std::uint32_t(0));
+    m_slot.stream << value;
+    std::uint32_t length =
+        static_cast<std::uint32_t>(m_line.size() - length_at - sizeof(length));
+    std::memcpy(m_line.data() + length_at, &length, sizeof(length));
+    return *this;
+  }
+
+  template <std::size_t N>
+  DeferredLogger &operator<<(const char (&literal)[N]) {
+    if (!plain())
+      return formatted(static_cast<const char *>(literal));
+    if (!detail::StaticText::contains(literal))
+      return string(literal, static_cast<std::size_t>(
+                                 std::find(literal, literal + N, '\0') -
+                                 literal));
+    m_line.push_back(detail::deferred_literal);
+    raw(static_cast<const char *>(literal));
+    return *this;
+  }
+
+  template <std::size_t N> DeferredLogger &operator<<(char (&buffer)[N]) {
+    return *this << static_cast<const char *>(buffer);
   }
 
-  static const char *levelLabel(Level level) {
-    switch (level) {
-    case Level::Trace:     return "  TRACE  ";
-    case Level::Debug:     return "  DEBUG  ";
-    case Level::Info:      return "  INFO   ";
-    case Level::Notice:    return " NOTICE  ";
-    case Level::Warning:   return " WARNING ";
-    case Level::Error:     return "  ERROR  ";
-    case Level::Critical:  return "CRITICAL ";
-    case Level::Alert:     return "  ALERT  ";
-    case Level::Emergency: return "EMERGENCY";
-    case Level::Profile:   return "PROFILING";
-    default:               return " UNKNOWN ";
+  template <typename C> DeferredLogger &operator<<(C *const &pointer) {
+    return pointer_argument(pointer);
+  }
+
+  DeferredLogger &operator<<(const std::string &value) {
+    return plain() ? string(value.data(), value.size()) : formatted(value);
+  }
+
+  DeferredLogger &operator<<(char value) {
+    if (!plain())
+      return formatted(value);
+    m_line.push_back(detail::deferred_char);
+    m_line.push_back(value);
+    return *this;
+  }
+
+  DeferredLogger &operator<<(int value) { return integer(value); }
+  DeferredLogger &operator<<(long value) { return integer(value); }
+  DeferredLogger &operator<<(long long value) { return integer(value); }
+  DeferredLogger &operator<<(unsigned value) { return integer(value); }
+  DeferredLogger &operator<<(unsigned long value) { return integer(value); }
+  DeferredLogger &operator<<(unsigned long long value) { return integer(value); }
+
+  DeferredLogger &operator<<(double value) {
+    if (!plain() || m_slot.stream.precision() != 6)
+      return formatted(value);
+    m_line.push_back(detail::deferred_double);
+    raw(value);
+    return *this;
+  }
+
+  template <typename F> DeferredLogger &operator<<(const Lazy<F> &value) {
+    if (detail::reaches_sink(static_cast<Level>(m_header.level)))
+      *this << value.call();
+    return *this;
+  }
+
+  // The writer formats the result with the stream's default state.
+  template <typename F> DeferredLogger &operator<<(const DeferredLazy<F> &value) {
+    m_line.push_back(detail::deferred_call);
+    raw(static_cast<detail::DeferredCall>(&detail::call_deferred<F>));
+    raw(static_cast<std::uint32_t>(sizeof(F)));
+    raw(value.call);
+    return *this;
+  }
+
+private:
+  detail::LineSlot &m_slot;
+  detail::LineBuffer &m_line;
+  detail::RecordHeader m_header;
+
+  bool plain() const {
+    return m_slot.stream.flags() ==
+               (std::ios_base::dec | std::ios_base::skipws) &&
+           m_slot.stream.width() == 0;
+  }
+
+  template <typename T> void raw(const T &value) {
+    m_line.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+
+  template <typename T> DeferredLogger &formatted(const T &value) {
+    return operator<< <T>(value);
+  }
+
+  // Strings are copied, other pointers formatted.
+  DeferredLogger &pointer_argument(const char *value) {
+    if (!value)
+      value = detail::null_string;
+    return plain() ? string(value, std::strlen(value)) : formatted(value);
+  }
+
+  DeferredLogger &pointer_argument(char *value) {
+    return pointer_argument(static_cast<const char *>(value));
+  }
+
+  template <typename C> DeferredLogger &pointer_argument(C *value) {
+    return formatted(value);
+  }
+
+  DeferredLogger &string(const char *data, std::size_t size) {
+    m_line.push_back(detail::deferred_string);
+    raw(static_cast<std::uint32_t>(size));
+    m_line.append(data, size);
+    return *this;
+  }
+
+  template <typename T> DeferredLogger &integer(T value) {
+    if (!plain())
+      return formatted(value);
+    if (value < 0) {
+      m_line.push_back(detail::deferred_signed);
+      raw(static_cast<long long>(value));
+    } else {
+      m_line.push_back(detail::deferred_unsigned);
+      raw(static_cast<unsigned long long>(value));
     }
+    return *this;
   }
 };
 
+// Adds a field to every record the calling thread logs while the Context is
+// alive, such as the id of the request being served:
+//
+//   log::Context request("request", id);
+//
+// The field is encoded once here, so each record only copies it. Contexts
+// nest and must be destroyed in reverse order, which a local variable is.
+class Context {
+public:
+  Context(const char *key, const char *value) : m_size(scoped_size()) {
+    detail::append_field(context().fields, key, value, std::strlen(value));
+  }
+
+  Context(const char *key, const std::string &value) : m_size(scoped_size()) {
+    detail::append_field(context().fields, key, value.data(), value.size());
+  }
+
+  Context(const char *key, int value) : m_size(scoped_size()) {
+    signed_field(key, value);
+  }
+
+  Context(const char *key, long value) : m_size(scoped_size()) {
+    signed_field(key, value);
+  }
+
+  Context(const char *key, long long value) : m_size(scoped_size()) {
+    signed_field(key, value);
+  }
+
+  Context(const char *key, unsigned value) : m_size(scoped_size()) {
+    unsigned_field(key, value);
+  }
+
+  Context(const char *key, unsigned long value) : m_size(scoped_size()) {
+    unsigned_field(key, value);
+  }
+
+  Context(const char *key, unsigned long long value) : m_size(scoped_size()) {
+    unsigned_field(key, value);
+  }
+
+  ~Context() { context().fields.truncate(context().name_size + m_size); }
+
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
+private:
+  static detail::ThreadContext &context() { return detail::thread_context(); }
+
+  // Bytes after the thread name, which set_thread_name() may resize.
+  static std::size_t scoped_size() {
+    return context().fields.size() - context().name_size;
+  }
+
+  void signed_field(const char *key, long long value) {
+    detail::append_field(context().fields, detail::field_signed, key, value);
+  }
+
+  void unsigned_field(const char *key, unsigned long long value) {
+    detail::append_field(context().fields, detail::field_unsigned, key, value);
+  }
+
+  std::size_t m_size; // scoped_size() before this Context
+};
+
+// Per call site: the category is interned on first use, after which a
+// disabled statement costs one relaxed load and a branch. The stream
+// arguments are not evaluated when the level is disabled.
+#define LOG_CATEGORY(category)                                                 \
+  []() -> const log::detail::Category & {                                      \
+    static const log::detail::Category &interned =                             \
+        log::detail::Categories::instance().intern(category);                  \
+    return interned;                                                           \
+  }()
+#define LOG_ENABLED(statement_level, category)                                 \
+  (log::detail::severity(statement_level) >=                                   \
+   LOG_CATEGORY(category).level.load(std::memory_order_relaxed))
+
+// The statement's CallSite, a constant without initialization code.
+#define LOG_CALL_SITE()                                                        \
+  []() -> const log::detail::CallSite * {                                      \
+    static const log::detail::CallSite site = {__FILE__, __LINE__};            \
+    return &site;                                                              \
+  }()
+
+// Guards a statement with both level checks. The compile-time one is a
+// constant, so stripped levels leave no code behind.
+#define LOG_STATEMENT(level, category)                                         \
+  if (!LOG_COMPILED(level) || !LOG_ENABLED(level, category)) {                \
+  } else
+
 // Log macros
-#ifdef NDEBUG
-#define log_trace(...)     if (true) {} else log::Logger(log::Level::Trace, #__VA_ARGS__)
-#define log_debug(...)     if (true) {} else log::Logger(log::Level::Debug, #__VA_ARGS__)
-#define log_info(...)      if (true) {} else log::Logger(log::Level::Info, #__VA_ARGS__)
-#define log_notice(...)    if (true) {} else log::Logger(log::Level::Notice, #__VA_ARGS__)
-#define log_warning(...)   if (true) {} else log::Logger(log::Level::Warning, #__VA_ARGS__)
-#define log_error(...)     if (true) {} else log::Logger(log::Level::Error, #__VA_ARGS__)
-#define log_critical(...)  if (true) {} else log::Logger(log::Level::Critical, #__VA_ARGS__)
-#define log_alert(...)     if (true) {} else log::Logger(log::Level::Alert, #__VA_ARGS__)
-#define log_emergency(...) if (true) {} else log::Logger(log::Level::Emergency, #__VA_ARGS__)
-#define log_profiling(...) if (true) {} else log::Logger(log::Level::Profile, #__VA_ARGS__)
-#else
-#define log_trace(...)     log::Logger(log::Level::Trace, #__VA_ARGS__)
-#define log_debug(...)     log::Logger(log::Level::Debug, #__VA_ARGS__)
-#define log_info(...)      log::Logger(log::Level::Info, #__VA_ARGS__)
-#define log_notice(...)    log::Logger(log::Level::Notice, #__VA_ARGS__)
-#define log_warning(...)   log::Logger(log::Level::Warning, #__VA_ARGS__)
-#define log_error(...)     log::Logger(log::Level::Error, #__VA_ARGS__)
-#define log_critical(...)  log::Logger(log::Level::Critical, #__VA_ARGS__)
-#define log_alert(...)     log::Logger(log::Level::Alert, #__VA_ARGS__)
-#define log_emergency(...) log::Logger(log::Level::Emergency, #__VA_ARGS__)
-#define log_profiling(...) log::Logger(log::Level::Profile, #__VA_ARGS__)
-#endif
+#define log_trace(...)     LOG_STATEMENT(log::Level::Trace, #__VA_ARGS__) log::Logger(log::Level::Trace, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_debug(...)     LOG_STATEMENT(log::Level::Debug, #__VA_ARGS__) log::Logger(log::Level::Debug, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_info(...)      LOG_STATEMENT(log::Level::Info, #__VA_ARGS__) log::Logger(log::Level::Info, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_notice(...)    LOG_STATEMENT(log::Level::Notice, #__VA_ARGS__) log::Logger(log::Level::Notice, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_warning(...)   LOG_STATEMENT(log::Level::Warning, #__VA_ARGS__) log::Logger(log::Level::Warning, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_error(...)     LOG_STATEMENT(log::Level::Error, #__VA_ARGS__) log::Logger(log::Level::Error, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_critical(...)  LOG_STATEMENT(log::Level::Critical, #__VA_ARGS__) log::Logger(log::Level::Critical, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_alert(...)     LOG_STATEMENT(log::Level::Alert, #__VA_ARGS__) log::Logger(log::Level::Alert, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_emergency(...) LOG_STATEMENT(log::Level::Emergency, #__VA_ARGS__) log::Logger(log::Level::Emergency, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+#define log_profiling(...) LOG_STATEMENT(log::Level::Profile, #__VA_ARGS__) log::Logger(log::Level::Profile, LOG_CATEGORY(#__VA_ARGS__).id, LOG_CALL_SITE())
+
+// Deferred log macros, see DeferredLogger.
+#define LOG_DEFERRED_SITE(level, category)                                     \
+  []() -> const log::detail::DeferredSite & {                                  \
+    static const log::detail::DeferredSite site = {level,                      \
+                                                   LOG_CATEGORY(category).id}; \
+    return site;                                                               \
+  }()
+#define log_deferred_trace(...)     LOG_STATEMENT(log::Level::Trace, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Trace, #__VA_ARGS__), LOG_CALL_SITE())
+#define log_deferred_debug(...)     LOG_STATEMENT(log::Level::Debug, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Debug, #__VA_ARGS__), LOG_CALL_SITE())
+#define log_deferred_info(...)      LOG_STATEMENT(log::Level::Info, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Info, #__VA_ARGS__), LOG_CALL_SITE())
+#define log_deferred_notice(...)    LOG_STATEMENT(log::Level::Notice, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Notice, #__VA_ARGS__), LOG_CALL_SITE())
+#define log_deferred_warning(...)   LOG_STATEMENT(log::Level::Warning, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Warning, #__VA_ARGS__), LOG_CALL_SITE())
+#define log_deferred_error(...)     LOG_STATEMENT(log::Level::Error, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Error, #__VA_ARGS__), LOG_CALL_SITE())
+#define log_deferred_critical(...)  LOG_STATEMENT(log::Level::Critical, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Critical, #__VA_ARGS__), LOG_CALL_SITE())
+#define log_deferred_alert(...)     LOG_STATEMENT(log::Level::Alert, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Alert, #__VA_ARGS__), LOG_CALL_SITE())
+#define log_deferred_emergency(...) LOG_STATEMENT(log::Level::Emergency, #__VA_ARGS__) log::DeferredLogger(LOG_DEFERRED_SITE(log::Level::Emergency, #__VA_ARGS__), LOG_CALL_SITE())
+
+// Rate-limited and sampled log macros, taking the level by name and an
+// optional category: log_limited(10, Warning) << ...; logs at most 10 a
+// second, log_every_n(100, Debug, net) << ...; one in 100. Held back
+// statements are not evaluated, see LimitSite.
+#define LOG_LIMIT_SITE()                                                       \
+  []() -> log::detail::LimitSite & {                                           \
+    static log::detail::LimitSite site(__FILE__, __LINE__);                    \
+    return site;                                                               \
+  }()
+#define LOG_LIMITED(level, category, check)                                    \
+  LOG_STATEMENT(level, category)                                               \
+  if (!LOG_LIMIT_SITE().check) {                                               \
+  } else                                                                       \
+    log::Logger(level, LOG_CATEGORY(category).id, LOG_CALL_SITE())
+// The forms with and without a category are told apart by the number of
+// arguments, so that the variadic part is never empty, which C++11 does not
+// allow.
+#define LOG_LIMITED_PICK(_1, _2, _3, name, ...) name
+#define LOG_LIMITED_CATEGORY(check, n, level, category)                        \
+  LOG_LIMITED(log::Level::level, #category,                                    \
+              check(n, log::Level::level, LOG_CATEGORY(#category).id))
+#define LOG_LIMITED_DEFAULT(check, n, level)                                   \
+  LOG_LIMITED(log::Level::level, "",                                           \
+              check(n, log::Level::level, LOG_CATEGORY("").id))
+#define log_limited(...)                                                       \
+  LOG_LIMITED_PICK(__VA_ARGS__, LOG_LIMITED_CATEGORY, LOG_LIMITED_DEFAULT,     \
+                   unused)(limit, __VA_ARGS__)
+#define log_every_n(...)                                                       \
+  LOG_LIMITED_PICK(__VA_ARGS__, LOG_LIMITED_CATEGORY, LOG_LIMITED_DEFAULT,     \
+                   unused)(sample, __VA_ARGS__)
 
 class ScopeLogger {
 public:
-  ScopeLogger(const std::string &tag, const char *file, int line)
-      : m_tag(tag), m_file_name(file), m_line(line),
-        m_start(std::chrono::steady_clock::now()) {
-    std::ostringstream oss;
-    oss << "START " << m_tag << " @ " << m_file_name << ":" << m_line;
-    log_profiling() << oss.str();
+  // tag and file are not copied and must outlive the scope, like the
+  // literals that log_profile() passes.
+  ScopeLogger(const char *tag, const char *file, int line)
+      : m_site(0), m_node(0), m_aggregate(false), m_tag(tag), m_file_name(file),
+        m_line(line) {
+    start();
+  }
+
+  // Times the scope of a log_profile() site, feeding its statistics instead
+  // of logging when ProfileMode::Aggregate is set.
+  explicit ScopeLogger(const detail::ProfileSite &site)
+      : m_site(&site), m_node(0),
+        m_aggregate(detail::profile_aggregating()),
+        m_tag(site.tag), m_file_name(site.file), m_line(site.line) {
+    if (m_aggregate) {
+      m_node = detail::profile_enter(site);
+      m_start = detail::ProfileTimer::instance().now();
+      return;
+    }
+    start();
   }
 
   ~ScopeLogger() noexcept {
-    auto now = std::chrono::steady_clock::now();
-    auto elapsed_us =
-        std::chrono::duration_cast<std::chrono::microseconds>(now - m_start)
-            .count();
-    double duration_ms = elapsed_us / 1000.0;
+    std::uint64_t now = detail::ProfileTimer::instance().now();
+    std::uint64_t elapsed = now > m_start ? now - m_start : 0;
+    if (m_site && detail::trace_active())
+      detail::trace_add(*m_site, m_start, elapsed);
+    if (m_aggregate) {
+      detail::profile_record(*m_site, m_node, elapsed, now);
+      return;
+    }
+    std::size_t depth = --detail::scope_depth();
 
     const char *leave_message =
         (std::uncaught_exception() ? "EXCEPTION!" : "FINISH");
 
-    std::ostringstream oss;
-    oss << leave_message << " " << m_tag << " (" << std::fixed
-        << std::setprecision(3) << duration_ms << "ms)"
-        << " @ " << m_file_name << ":" << m_line;
+    char duration_ms[32];
+    std::snprintf(duration_ms, sizeof(duration_ms), "%.6f", elapsed / 1e6);
 
-    log_profiling() << oss.str();
+    log_profiling() << detail::scope_indent(depth) << leave_message << ' '
+                    << m_tag << " (" << duration_ms << "ms) @ " << m_file_name
+                    << ':' << m_line;
   }
 
   ScopeLogger(const ScopeLogger &) = delete;
@@ -154,18 +587,34 @@ public:
   ScopeLogger &operator=(ScopeLogger &&) = default;
 
 private:
-  std::string m_tag;
-  std::string m_file_name;
+  // Logs the START line, indented by the number of enclosing scopes; the
+  // scope is timed from after it. The depth is counted even when Profile is
+  // filtered out, since the destructor always takes it back.
+  void start() {
+    std::size_t depth = detail::scope_depth()++;
+    log_profiling() << detail::scope_indent(depth) << "START " << m_tag
+                    << " @ " << m_file_name << ':' << m_line;
+    m_start = detail::ProfileTimer::instance().now();
+  }
+
+  const detail::ProfileSite *m_site; // null for the tag constructor
+  detail::ScopeNode *m_node;         // in the thread's call tree, or null
+  bool m_aggregate;
+  const char *m_tag;
+  const char *m_file_name;
   int m_line;
-  std::chrono::steady_clock::time_point m_start;
+  std::uint64_t m_start; // ProfileTimer nanoseconds
 };
 
-#ifdef NDEBUG
+#if LOG_COMPILE_LEVEL > LOG_LEVEL_DEBUG
 #define log_profile(tag)
 #else
 #define CONCAT_IMPL(x, y) x##y
 #define CONCAT(x, y) CONCAT_IMPL(x, y)
-#define log_profile(tag) log::ScopeLogger CONCAT(_scopelogger_, __LINE__) { #tag, __FILE__, __LINE__ }
+#define log_profile(tag)                                                       \
+  static const log::detail::ProfileSite CONCAT(_profilesite_, __LINE__)(       \
+      #tag, __FILE__, __LINE__);                                               \
+  log::ScopeLogger CONCAT(_scopelogger_, __LINE__)(CONCAT(_profilesite_, __LINE__))
 #endif
 
 } // namespace log
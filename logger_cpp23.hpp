@@ -1,5 +1,5 @@
 /*
- * logger.hpp
+ * logger_cpp23.hpp
  * Copyright (c) 2025 João Pedro Foscarini
  * SPDX-License-Identifier: MIT
  *
@@ -10,141 +10,746 @@
 
 #pragma once
 
-#include <chrono>
-#include <iomanip>
-#include <iostream>
-#include <print>
+// C++23 front-end: the log statements of logger_cpp11.hpp plus compile-time
+// checked std::format strings, with std::source_location for the call sites.
+
+#include "logger_core.hpp"
+
+#include <charconv>
+#include <concepts>
+#include <format>
+#include <iterator>
+#include <new>
 #include <source_location>
-#include <sstream>
+#include <string_view>
+#include <tuple>
 
 namespace log {
+namespace detail {
+
+inline bool read_string(const char*& in, const char* end, std::string_view& value) {
+    std::uint32_t length;
+    if (!read_raw(in, end, length) || static_cast<std::size_t>(end - in) < length)
+        return false;
+    value = {in, length};
+    in += length;
+    return true;
+}
+
+template <typename T>
+concept string_like = std::convertible_to<const T&, std::string_view>;
+
+// Streamed as characters rather than numbers, as std::ostream does.
+template <typename T>
+concept character =
+    std::same_as<T, char> || std::same_as<T, signed char> || std::same_as<T, unsigned char>;
+
+// Arguments of DeferredLogger::format(): strings are copied, anything else
+// must be safe to copy bitwise and format later.
+template <typename T>
+concept deferred_argument =
+    string_like<T> ||
+    (std::is_trivially_copyable_v<T> && std::default_initializable<T>);
+
+template <typename T>
+using deferred_stored_t =
+    std::conditional_t<string_like<T>, std::string_view, T>;
+
+template <typename T> void encode_argument(LineBuffer& line, const T& value) {
+    if constexpr (string_like<T>) {
+        const std::string_view text(value);
+        const auto             length = static_cast<std::uint32_t>(text.size());
+        line.append(reinterpret_cast<const char*>(&length), sizeof(length));
+        line.append(text.data(), text.size());
+    } else {
+        line.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+}
+
+template <typename T>
+bool decode_argument(const char*& in, const char* end, deferred_stored_t<T>& value) {
+    if constexpr (string_like<T>)
+        return read_string(in, end, value);
+    else
+        return read_raw(in, end, value);
+}
+
+// Formats the arguments of DeferredLogger::format() with these types.
+template <typename... Args>
+bool format_arguments(LineBuffer&  out,
+                      const char*  format,
+                      std::size_t  size,
+                      const char*& in,
+                      const char*  end) {
+    std::tuple<deferred_stored_t<Args>...> values;
+    const bool complete = std::apply(
+        [&](auto&... value) { return (decode_argument<Args>(in, end, value) && ...); },
+        values);
+    if (!complete) return false;
+    std::apply(
+        [&](const auto&... value) {
+            std::vformat_to(std::back_inserter(out),
+                            std::string_view(format, size),
+                            std::make_format_args(value...));
+        },
+        values);
+    return true;
+}
+
+// The argument as a DeferredValue, where std::format() treats it like one of
+// those types: signed char and unsigned char are numbers there.
+template <typename T>
+bool split_argument(std::vector<DeferredValue>& values, const deferred_stored_t<T>& value) {
+    DeferredValue split{};
+    if constexpr (string_like<T>) {
+        split.type = deferred_string;
+        split.data = value.data();
+        split.size = value.size();
+    } else if constexpr (std::same_as<T, bool>) {
+        split.type = deferred_bool;
+        split.signed_integer = value;
+    } else if constexpr (std::same_as<T, char>) {
+        split.type = deferred_char;
+        split.signed_integer = value;
+    } else if constexpr (std::signed_integral<T> && sizeof(T) <= sizeof(long long)) {
+        split.type = deferred_signed;
+        split.signed_integer = value;
+    } else if constexpr (std::unsigned_integral<T> && sizeof(T) <= sizeof(long long)) {
+        split.type = deferred_unsigned;
+        split.unsigned_integer = value;
+    } else if constexpr (std::same_as<T, double>) {
+        split.type = deferred_double;
+        split.number = value;
+    } else {
+        return false;
+    }
+    values.push_back(split);
+    return true;
+}
+
+template <typename... Args>
+bool split_arguments(std::vector<DeferredValue>& values, const char*& in, const char* end) {
+    std::tuple<deferred_stored_t<Args>...> stored;
+    const bool complete = std::apply(
+        [&](auto&... value) { return (decode_argument<Args>(in, end, value) && ...); },
+        stored);
+    return complete &&
+           std::apply(
+               [&](const auto&... value) { return (split_argument<Args>(values, value) && ...); },
+               stored);
+}
+
+template <typename... Args>
+inline constexpr DeferredFormatter deferred_formatter{&format_arguments<Args...>,
+                                                      &split_arguments<Args...>};
+
+// Fields with a std::string_view key, see Logger::kv() and Context.
+template <typename T>
+void append_field(LineBuffer& fields, FieldType type, std::string_view key, T value) {
+    append_field_key(fields, type, key.data(), key.size());
+    fields.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+inline void append_field(LineBuffer& fields, std::string_view key, std::string_view text) {
+    append_field_key(fields, field_string, key.data(), key.size());
+    const auto length = static_cast<std::uint32_t>(text.size());
+    fields.append(reinterpret_cast<const char*>(&length), sizeof(length));
+    fields.append(text.data(), text.size());
+}
+
+} // namespace detail
+
+// A callable streamed or formatted in place of its result, which is only
+// computed when the record can reach a sink:
+//
+//   log_debug() << "state " << log::lazy([&] { return dump(state); });
+template <typename F> struct Lazy {
+    F call;
+};
+
+template <typename F> Lazy<F> lazy(F call) { return {std::move(call)}; }
+
+// lazy() whose call runs where the record is formatted, normally on the
+// writer thread, when it is an argument of a log_deferred_*() statement;
+// elsewhere it is a lazy(). The callable is copied bitwise into the record,
+// so everything it refers to must outlive the record: capture by value. It
+// must not log.
+template <typename F>
+    requires std::is_trivially_copyable_v<F>
+class DeferredLazy {
+  public:
+    DeferredLazy() = default;
+    explicit DeferredLazy(const F& call) { std::memcpy(m_bytes, &call, sizeof(F)); }
+
+    decltype(auto) operator()() const {
+        return (*std::launder(reinterpret_cast<const F*>(m_bytes)))();
+    }
+
+  private:
+    // Bytes rather than an F, which need not be default constructible.
+    alignas(F) unsigned char m_bytes[sizeof(F)];
+};
+
+template <typename F> DeferredLazy<F> deferred(const F& call) { return DeferredLazy<F>(call); }
+
+namespace detail {
+
+template <typename T> inline constexpr bool is_lazy = false;
+template <typename F> inline constexpr bool is_lazy<Lazy<F>> = true;
+
+// What DeferredLogger::format() stores for an argument: the result of a
+// lazy() call, made on the logging thread, or the argument itself.
+template <typename T> struct deferred_result {
+    using type = T;
+};
+template <typename F> struct deferred_result<Lazy<F>> {
+    using type = std::decay_t<std::invoke_result_t<const F&>>;
+};
+template <typename T> using deferred_result_t = typename deferred_result<T>::type;
+
+template <typename T> decltype(auto) deferred_value(const T& value) {
+    if constexpr (is_lazy<T>)
+        return value.call();
+    else
+        return (value);
+}
 
-enum class Level { Trace, Debug, Info, Notice, Warning, Error, Critical, Alert, Emergency, Profile };
+// The DeferredCall of a log::deferred() callable: formats its result as "{}"
+// would.
+template <typename F> void call_deferred(const char* closure, LineBuffer& out) {
+    DeferredLazy<F> value;
+    std::memcpy(&value, closure, sizeof(value));
+    std::format_to(std::back_inserter(out), "{}", value());
+}
+
+} // namespace detail
 
 class Logger {
   public:
-    explicit Logger(Level level, const std::string& category = {})
-        : m_stream() {
-        m_stream << "[" << timestamp() << "][" << colorCode(level)
-                 << levelLabel(level) << "\033[0m]";
-        if (!category.empty()) m_stream << "[" << category << "]";
-        m_stream << " ";
+    // category is an id from detail::Categories, 0 being uncategorized; site
+    // is the statement's, which the log macros pass.
+    explicit Logger(Level level, std::uint16_t category = 0,
+                    const detail::CallSite* site = nullptr)
+        : m_slot(detail::acquire_line()), m_line(m_slot.line) {
+        start(level, category, site);
+    }
+
+    Logger(Level level, std::string_view category)
+        : m_slot(detail::acquire_line()), m_line(m_slot.line) {
+        start(level, detail::Categories::instance().intern(std::string(category)).id, nullptr);
     }
 
     ~Logger() {
-        m_stream << "\033[0m";
-        std::clog << m_stream.str() << '\n';
+        detail::end_fields(m_header, m_line, m_slot.fields);
+        detail::submit(m_header, m_line);
+        detail::release_line();
     }
 
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
     template <typename T> Logger& operator<<(const T& value) {
-        m_stream << value;
+        m_slot.stream << value;
+        return *this;
+    }
+
+    template <typename T>
+        requires std::convertible_to<const T&, std::string_view>
+    Logger& operator<<(const T& value) {
+        if constexpr (std::is_pointer_v<T>)
+            if (!value) return *this << std::string_view(detail::null_string);
+        if (plain()) {
+            const std::string_view text(value);
+            m_line.append(text.data(), text.size());
+        } else {
+            m_slot.stream << value;
+        }
+        return *this;
+    }
+
+    Logger& operator<<(char value) {
+        if (plain())
+            m_line.push_back(value);
+        else
+            m_slot.stream << value;
+        return *this;
+    }
+
+    template <typename T>
+        requires((std::integral<T> && !std::same_as<T, bool> && !detail::character<T>) ||
+                 std::floating_point<T>)
+    Logger& operator<<(const T& value) {
+        if (plain()) {
+            constexpr std::size_t room = 32;
+            char*                 out = m_line.reserve(room);
+            std::to_chars_result  result;
+            if constexpr (std::floating_point<T>)
+                result = std::to_chars(out,
+                                       out + room,
+                                       value,
+                                       std::chars_format::general,
+                                       static_cast<int>(m_slot.stream.precision()));
+            else
+                result = std::to_chars(out, out + room, value);
+            if (result.ec == std::errc{}) {
+                m_line.commit(static_cast<std::size_t>(result.ptr - out));
+                return *this;
+            }
+        }
+        m_slot.stream << value;
+        return *this;
+    }
+
+    template <typename F> Logger& operator<<(const Lazy<F>& value) {
+        if (detail::reaches_sink(static_cast<Level>(m_header.level))) *this << value.call();
+        return *this;
+    }
+
+    template <typename F> Logger& operator<<(const DeferredLazy<F>& value) {
+        if (detail::reaches_sink(static_cast<Level>(m_header.level))) *this << value();
+        return *this;
+    }
+
+    // Formats straight into the record with a compile-time checked
+    // std::format string; no stream, sentry or locale is involved. With a
+    // lazy() argument nothing is formatted unless the record can reach a sink.
+    template <typename... Args>
+    Logger& format(std::format_string<Args...> format, Args&&... args) {
+        if constexpr ((detail::is_lazy<std::remove_cvref_t<Args>> || ...))
+            if (!detail::reaches_sink(static_cast<Level>(m_header.level))) return *this;
+        std::format_to(std::back_inserter(m_line), format, std::forward<Args>(args)...);
+        return *this;
+    }
+
+    // Structured fields, kept apart from the message: sinks with
+    // Encoding::Json write them as JSON members, the others as key=value.
+    // Keys are cut at 255 bytes.
+    template <typename T>
+        requires std::convertible_to<const T&, std::string_view>
+    Logger& kv(std::string_view key, const T& value) {
+        detail::append_field(m_slot.fields, key, std::string_view(value));
+        return *this;
+    }
+
+    template <std::same_as<bool> T> Logger& kv(std::string_view key, T value) {
+        detail::append_field(m_slot.fields, detail::field_bool, key, value);
+        return *this;
+    }
+
+    template <typename T>
+        requires(std::integral<T> && !std::same_as<T, bool>)
+    Logger& kv(std::string_view key, T value) {
+        if constexpr (std::signed_integral<T>)
+            detail::append_field(m_slot.fields, detail::field_signed, key,
+                                 static_cast<long long>(value));
+        else
+            detail::append_field(m_slot.fields, detail::field_unsigned, key,
+                                 static_cast<unsigned long long>(value));
+        return *this;
+    }
+
+    template <std::floating_point T> Logger& kv(std::string_view key, T value) {
+        detail::append_field(m_slot.fields, detail::field_double, key, static_cast<double>(value));
         return *this;
     }
 
   private:
-    std::ostringstream m_stream;
-
-    std::string timestamp() const {
-        using namespace std::chrono;
-        auto    now = system_clock::now();
-        auto    ms = duration_cast<milliseconds>(now.time_since_epoch()) % 1000;
-        auto    itt = system_clock::to_time_t(now);
-        std::tm tm;
-#if defined(_WIN32)
-        localtime_s(&tm, &itt);
-#else
-        localtime_r(&itt, &tm);
-#endif
-        std::ostringstream oss;
-        oss << std::put_time(&tm, "%T") << "." << std::setw(3)
-            << std::setfill('0') << ms.count();
-        return oss.str();
-    }
-
-    static const char* colorCode(Level level) {
-        switch (level) {
-            case Level::Trace:     return "\033[1;37m";
-            case Level::Debug:     return "\033[1;34m";
-            case Level::Info:      return "\033[1;32m";
-            case Level::Notice:    return "\033[1;36m";
-            case Level::Warning:   return "\033[1;33m";
-            case Level::Error:     return "\033[1;31m";
-            case Level::Critical:  return "\033[1;35m";
-            case Level::Alert:     return "\033[1;41m";
-            case Level::Emergency: return "\033[1;41;97m";
-            case Level::Profile:   return "\033[1;36m";
-            default:               return "\033[0m";
+    detail::LineSlot&                     m_slot;
+    detail::LineBuffer&                   m_line;
+    detail::RecordHeader                  m_header;
+
+    void start(Level level, std::uint16_t category, const detail::CallSite* site) {
+        m_header.flags = 0;
+        m_header.level = static_cast<std::uint8_t>(level);
+        m_header.category = category;
+        m_header.site = site;
+        detail::stamp(m_header);
+    }
+
+    // True while no manipulator has changed the stream's formatting state.
+    bool plain() const {
+        return m_slot.stream.flags() ==
+                   (std::ios_base::dec | std::ios_base::skipws) &&
+               m_slot.stream.width() == 0;
+    }
+};
+
+// Logger variant for hot paths: operator<< and format() only copy the
+// argument values into the record and the text is produced on the writer
+// thread (or in the destructor when the writer is not running). Types without
+// a binary encoding are formatted immediately by operator<<. The format
+// string of a log_deferred_*() statement is kept in its call site. Of a const
+// char array streamed only the address is recorded when it is in the
+// executable's read-only data, a string literal; other arrays are copied,
+// see detail::StaticText.
+class DeferredLogger {
+  public:
+    explicit DeferredLogger(const detail::DeferredSite& site,
+                            const detail::CallSite*     call = nullptr)
+        : m_slot(detail::acquire_line()), m_line(m_slot.line), m_site(site) {
+        m_header.flags = detail::record_deferred;
+        m_header.level = static_cast<std::uint8_t>(site.level);
+        m_header.category = site.category;
+        m_header.site = call;
+        detail::stamp(m_header);
+        raw(&site);
+    }
+
+    ~DeferredLogger() {
+        detail::end_fields(m_header, m_line, m_slot.fields);
+        detail::submit(m_header, m_line);
+        detail::release_line();
+    }
+
+    DeferredLogger(const DeferredLogger&) = delete;
+    DeferredLogger& operator=(const DeferredLogger&) = delete;
+
+    template <typename T> DeferredLogger& operator<<(const T& value) {
+        if constexpr (detail::string_like<T> && std::is_pointer_v<T>)
+            if (!value) return *this << std::string_view(detail::null_string);
+        if constexpr (detail::string_like<T>) {
+            if (plain()) {
+                m_line.push_back(detail::deferred_string);
+                detail::encode_argument(m_line, value);
+                return *this;
+            }
+        } else if constexpr (detail::character<T>) {
+            if (plain()) {
+                m_line.push_back(detail::deferred_char);
+                raw(static_cast<char>(value));
+                return *this;
+            }
+        } else if constexpr (std::integral<T> && !std::same_as<T, bool>) {
+            if (plain()) {
+                if (value < 0) {
+                    m_line.push_back(detail::deferred_signed);
+                    raw(static_cast<long long>(value));
+                } else {
+                    m_line.push_back(detail::deferred_unsigned);
+                    raw(static_cast<unsigned long long>(value));
+                }
+                return *this;
+            }
+        } else if constexpr (std::floating_point<T>) {
+            if (plain() && m_slot.stream.precision() == 6) {
+                m_line.push_back(detail::deferred_double);
+                raw(static_cast<double>(value));
+                return *this;
+            }
         }
+        m_line.push_back(detail::deferred_string);
+        const std::size_t length_at = m_line.size();
+        raw(std::uint32_t{0});
+        m_slot.stream << value;
+        const auto length =
+            static_cast<std::uint32_t>(m_line.size() - length_at - sizeof(std::uint32_t));
+        std::memcpy(m_line.data() + length_at, &length, sizeof(length));
+        return *this;
     }
 
-    static const char* levelLabel(Level level) {
-        switch (level) {
-            case Level::Trace:     return "  TRACE  ";
-            case Level::Debug:     return "  DEBUG  ";
-            case Level::Info:      return "  INFO   ";
-            case Level::Notice:    return " NOTICE  ";
-            case Level::Warning:   return " WARNING ";
-            case Level::Error:     return "  ERROR  ";
-            case Level::Critical:  return "CRITICAL ";
-            case Level::Alert:     return "  ALERT  ";
-            case Level::Emergency: return "EMERGENCY";
-            case Level::Profile:   return "PROFILING";
-            default:               return " UNKNOWN ";
+    template <std::size_t N> DeferredLogger& operator<<(const char (&literal)[N]) {
+        if (!plain()) return operator<< <const char*>(literal);
+        if (!detail::StaticText::contains(literal))
+            return *this << std::string_view(literal, std::find(literal, literal + N, '\0'));
+        m_line.push_back(detail::deferred_literal);
+        raw(static_cast<const char*>(literal));
+        return *this;
+    }
+
+    template <std::size_t N> DeferredLogger& operator<<(char (&buffer)[N]) {
+        return *this << std::string_view(buffer);
+    }
+
+    template <typename F> DeferredLogger& operator<<(const Lazy<F>& value) {
+        if (detail::reaches_sink(static_cast<Level>(m_header.level))) *this << value.call();
+        return *this;
+    }
+
+    // The writer formats the result as "{}" would.
+    template <typename F> DeferredLogger& operator<<(const DeferredLazy<F>& value) {
+        m_line.push_back(detail::deferred_call);
+        raw(static_cast<detail::DeferredCall>(&detail::call_deferred<F>));
+        raw(static_cast<std::uint32_t>(sizeof(value)));
+        raw(value);
+        return *this;
+    }
+
+    // A lazy() argument is called here and its result stored like the other
+    // arguments, so the result must be one that can be; nothing is recorded
+    // unless the record can reach a sink, as with Logger::format().
+    template <typename... Args>
+        requires(detail::deferred_argument<detail::deferred_result_t<std::decay_t<Args>>> && ...)
+    DeferredLogger& format(std::format_string<Args...> format, Args&&... args) {
+        if constexpr ((detail::is_lazy<std::decay_t<Args>> || ...))
+            if (!detail::reaches_sink(static_cast<Level>(m_header.level))) return *this;
+        const detail::DeferredFormatter& formatter =
+            detail::deferred_formatter<detail::deferred_result_t<std::decay_t<Args>>...>;
+        if (describes(format.get(), formatter)) {
+            m_line.push_back(detail::deferred_format);
+        } else {
+            m_line.push_back(detail::deferred_format_inline);
+            raw(&formatter);
+            detail::encode_argument(m_line, format.get());
         }
+        (detail::encode_argument<detail::deferred_result_t<std::decay_t<Args>>>(
+             m_line, detail::deferred_value(args)),
+         ...);
+        return *this;
+    }
+
+  private:
+    detail::LineSlot&           m_slot;
+    detail::LineBuffer&         m_line;
+    const detail::DeferredSite& m_site;
+    detail::RecordHeader        m_header;
+
+    // Whether the site holds this format string and formatter; the first
+    // call publishes the formatter.
+    bool describes(std::string_view format, const detail::DeferredFormatter& formatter) const {
+        if (!m_site.format ||
+            (m_site.format != format.data() &&
+             std::string_view(m_site.format, m_site.format_size) != format))
+            return false;
+        const detail::DeferredFormatter* published =
+            m_site.formatter.load(std::memory_order_relaxed);
+        if (!published &&
+            m_site.formatter.compare_exchange_strong(published, &formatter,
+                                                     std::memory_order_relaxed))
+            return true;
+        return published == &formatter;
+    }
+
+    bool plain() const {
+        return m_slot.stream.flags() ==
+                   (std::ios_base::dec | std::ios_base::skipws) &&
+               m_slot.stream.width() == 0;
+    }
+
+    template <typename T> void raw(const T& value) {
+        m_line.append(reinterpret_cast<const char*>(&value), sizeof(T));
     }
 };
 
-#ifdef NDEBUG
-#define log_trace(...)     if (true) {} else log::Logger(log::Level::Trace, #__VA_ARGS__)
-#define log_debug(...)     if (true) {} else log::Logger(log::Level::Debug, #__VA_ARGS__)
-#define log_info(...)      if (true) {} else log::Logger(log::Level::Info, #__VA_ARGS__)
-#define log_notice(...)    if (true) {} else log::Logger(log::Level::Notice, #__VA_ARGS__)
-#define log_warning(...)   if (true) {} else log::Logger(log::Level::Warning, #__VA_ARGS__)
-#define log_error(...)     if (true) {} else log::Logger(log::Level::Error, #__VA_ARGS__)
-#define log_critical(...)  if (true) {} else log::Logger(log::Level::Critical, #__VA_ARGS__)
-#define log_alert(...)     if (true) {} else log::Logger(log::Level::Alert, #__VA_ARGS__)
-#define log_emergency(...) if (true) {} else log::Logger(log::Level::Emergency, #__VA_ARGS__)
-#define log_profiling(...) if (true) {} else log::Logger(log::Level::Profile, #__VA_ARGS__)
-#else
-#define log_trace(...)     log::Logger(log::Level::Trace, #__VA_ARGS__)
-#define log_debug(...)     log::Logger(log::Level::Debug, #__VA_ARGS__)
-#define log_info(...)      log::Logger(log::Level::Info, #__VA_ARGS__)
-#define log_notice(...)    log::Logger(log::Level::Notice, #__VA_ARGS__)
-#define log_warning(...)   log::Logger(log::Level::Warning, #__VA_ARGS__)
-#define log_error(...)     log::Logger(log::Level::Error, #__VA_ARGS__)
-#define log_critical(...)  log::Logger(log::Level::Critical, #__VA_ARGS__)
-#define log_alert(...)     log::Logger(log::Level::Alert, #__VA_ARGS__)
-#define log_emergency(...) log::Logger(log::Level::Emergency, #__VA_ARGS__)
-#define log_profiling(...) log::Logger(log::Level::Profile, #__VA_ARGS__)
-#endif
+// Adds a field to every record the calling thread logs while the Context is
+// alive, such as the id of the request being served:
+//
+//   log::Context request{"request", id};
+//
+// The field is encoded once here, so each record only copies it. Contexts
+// nest and must be destroyed in reverse order, which a local variable is.
+class Context {
+  public:
+    template <typename T>
+        requires std::convertible_to<const T&, std::string_view>
+    Context(std::string_view key, const T& value) {
+        detail::append_field(detail::thread_context().fields, key, std::string_view(value));
+    }
+
+    template <typename T>
+        requires(std::integral<T> && !std::same_as<T, bool>)
+    Context(std::string_view key, T value) {
+        if constexpr (std::signed_integral<T>)
+            detail::append_field(detail::thread_context().fields, detail::field_signed, key,
+                                 static_cast<long long>(value));
+        else
+            detail::append_field(detail::thread_context().fields, detail::field_unsigned, key,
+                                 static_cast<unsigned long long>(value));
+    }
+
+    ~Context() {
+        auto& context = detail::thread_context();
+        context.fields.truncate(context.name_size + m_size);
+    }
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+  private:
+    // Bytes after the thread name, which set_thread_name() may resize.
+    std::size_t m_size =
+        detail::thread_context().fields.size() - detail::thread_context().name_size;
+};
+
+namespace detail {
+
+// The category in the stringified arguments of a log macro: the text before
+// the first comma, which starts the format string if there is one.
+constexpr std::string_view category_name(std::string_view arguments) {
+    arguments = arguments.substr(0, arguments.find(','));
+    while (!arguments.empty() && arguments.back() == ' ') arguments.remove_suffix(1);
+    return arguments;
+}
+
+} // namespace detail
+
+// Per call site: the category is interned on first use, after which a
+// disabled statement costs one relaxed load and a branch. The stream
+// arguments are not evaluated when the level is disabled.
+#define LOG_CATEGORY(category)                                                 \
+    []() -> const log::detail::Category& {                                     \
+        static const log::detail::Category& interned =                         \
+            log::detail::Categories::instance().intern(std::string(category)); \
+        return interned;                                                       \
+    }()
+#define LOG_ENABLED(statement_level, category)                                 \
+    (log::detail::severity(statement_level) >=                                 \
+     LOG_CATEGORY(category).level.load(std::memory_order_relaxed))
+
+// The statement's CallSite, a constant without initialization code.
+#define LOG_CALL_SITE()                                                        \
+    []() -> const log::detail::CallSite* {                                     \
+        static constexpr std::source_location location =                      \
+            std::source_location::current();                                   \
+        static constexpr log::detail::CallSite site{                           \
+            location.file_name(), static_cast<int>(location.line())};          \
+        return &site;                                                          \
+    }()
+
+// Guards a statement with both level checks. Stripped levels are discarded
+// by if constexpr and never reach the runtime check.
+#define LOG_STATEMENT(level, category)                                         \
+    if constexpr (!LOG_COMPILED(level)) {                                      \
+    } else if (!LOG_ENABLED(level, category)) {                                \
+    } else
+
+// A log macro takes an optional category and streams with <<:
+// log_info() << ...; or log_info(NET) << ...;. With a format string and its
+// arguments after the category it formats instead, checked at compile time:
+// log_info(NET, "conn {} sent {} bytes", id, n); or log_info(, "...", ...);
+// without a category. The category is read from the stringified arguments,
+// so it is never macro-expanded.
+#define LOG_PICK(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14,   \
+                 _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26,   \
+                 _27, _28, _29, _30, _31, _32, name, ...)                      \
+    name
+#define LOG_SELECT(stream, formatted, ...)                                     \
+    LOG_PICK(__VA_ARGS__, formatted, formatted, formatted, formatted,          \
+             formatted, formatted, formatted, formatted, formatted, formatted, \
+             formatted, formatted, formatted, formatted, formatted, formatted, \
+             formatted, formatted, formatted, formatted, formatted, formatted, \
+             formatted, formatted, formatted, formatted, formatted, formatted, \
+             formatted, formatted, formatted, stream, unused)
+#define LOG_CATEGORY_NAME(arguments) log::detail::category_name(arguments)
+#define LOG_STREAM(level, arguments, ...)                                      \
+    LOG_STATEMENT(level, LOG_CATEGORY_NAME(arguments))                         \
+    log::Logger(level, LOG_CATEGORY(LOG_CATEGORY_NAME(arguments)).id, LOG_CALL_SITE())
+#define LOG_FORMAT(level, arguments, category, ...)                            \
+    LOG_STREAM(level, arguments).format(__VA_ARGS__)
+
+#define log_trace(...)     LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Trace, #__VA_ARGS__, __VA_ARGS__)
+#define log_debug(...)     LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Debug, #__VA_ARGS__, __VA_ARGS__)
+#define log_info(...)      LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Info, #__VA_ARGS__, __VA_ARGS__)
+#define log_notice(...)    LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Notice, #__VA_ARGS__, __VA_ARGS__)
+#define log_warning(...)   LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Warning, #__VA_ARGS__, __VA_ARGS__)
+#define log_error(...)     LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Error, #__VA_ARGS__, __VA_ARGS__)
+#define log_critical(...)  LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Critical, #__VA_ARGS__, __VA_ARGS__)
+#define log_alert(...)     LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Alert, #__VA_ARGS__, __VA_ARGS__)
+#define log_emergency(...) LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Emergency, #__VA_ARGS__, __VA_ARGS__)
+#define log_profiling(...) LOG_SELECT(LOG_STREAM, LOG_FORMAT, __VA_ARGS__)(log::Level::Profile, #__VA_ARGS__, __VA_ARGS__)
+
+// Deferred log macros, see DeferredLogger.
+#define LOG_DEFERRED_SITE(level, category)                                     \
+    []() -> const log::detail::DeferredSite& {                                 \
+        static const log::detail::DeferredSite site{level,                     \
+                                                    LOG_CATEGORY(category).id};\
+        return site;                                                           \
+    }()
+#define LOG_DEFERRED_FORMAT_SITE(level, category, text)                        \
+    []() -> const log::detail::DeferredSite& {                                 \
+        static const log::detail::DeferredSite site{                           \
+            level, LOG_CATEGORY(category).id, std::string_view(text).data(),   \
+            std::string_view(text).size()};                                    \
+        return site;                                                           \
+    }()
+#define LOG_DEFERRED_STREAM(level, arguments, ...)                             \
+    LOG_STATEMENT(level, LOG_CATEGORY_NAME(arguments))                         \
+    log::DeferredLogger(                                                       \
+        LOG_DEFERRED_SITE(level, LOG_CATEGORY_NAME(arguments)), LOG_CALL_SITE())
+#define LOG_DEFERRED_FORMAT(level, arguments, category, text, ...)             \
+    LOG_STATEMENT(level, LOG_CATEGORY_NAME(arguments))                         \
+    log::DeferredLogger(LOG_DEFERRED_FORMAT_SITE(                              \
+                            level, LOG_CATEGORY_NAME(arguments), text),        \
+                        LOG_CALL_SITE())                                       \
+        .format(text __VA_OPT__(, ) __VA_ARGS__)
+#define log_deferred_trace(...)     LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Trace, #__VA_ARGS__, __VA_ARGS__)
+#define log_deferred_debug(...)     LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Debug, #__VA_ARGS__, __VA_ARGS__)
+#define log_deferred_info(...)      LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Info, #__VA_ARGS__, __VA_ARGS__)
+#define log_deferred_notice(...)    LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Notice, #__VA_ARGS__, __VA_ARGS__)
+#define log_deferred_warning(...)   LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Warning, #__VA_ARGS__, __VA_ARGS__)
+#define log_deferred_error(...)     LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Error, #__VA_ARGS__, __VA_ARGS__)
+#define log_deferred_critical(...)  LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Critical, #__VA_ARGS__, __VA_ARGS__)
+#define log_deferred_alert(...)     LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Alert, #__VA_ARGS__, __VA_ARGS__)
+#define log_deferred_emergency(...) LOG_SELECT(LOG_DEFERRED_STREAM, LOG_DEFERRED_FORMAT, __VA_ARGS__)(log::Level::Emergency, #__VA_ARGS__, __VA_ARGS__)
+
+// Rate-limited and sampled log macros, taking the level by name and an
+// optional category: log_limited(10, Warning) << ...; logs at most 10 a
+// second, log_every_n(100, Debug, net) << ...; one in 100. Held back
+// statements are not evaluated, see LimitSite.
+#define LOG_LIMIT_SITE()                                                       \
+    []() -> log::detail::LimitSite& {                                          \
+        static constexpr std::source_location location =                      \
+            std::source_location::current();                                   \
+        static log::detail::LimitSite site{location.file_name(),               \
+                                           static_cast<int>(location.line())}; \
+        return site;                                                           \
+    }()
+#define LOG_LIMITED(level, category, check)                                    \
+    LOG_STATEMENT(level, category)                                             \
+    if (!LOG_LIMIT_SITE().check) {                                             \
+    } else                                                                     \
+        log::Logger(level, LOG_CATEGORY(category).id, LOG_CALL_SITE())
+#define log_limited(per_second, level, ...)                                    \
+    LOG_LIMITED(log::Level::level, #__VA_ARGS__,                               \
+                limit(per_second, log::Level::level, LOG_CATEGORY(#__VA_ARGS__).id))
+#define log_every_n(n, level, ...)                                             \
+    LOG_LIMITED(log::Level::level, #__VA_ARGS__,                               \
+                sample(n, log::Level::level, LOG_CATEGORY(#__VA_ARGS__).id))
 
 class ScopeLogger {
   public:
     explicit ScopeLogger(
         std::string_view            tag = {},
         const std::source_location& location = std::source_location::current())
-        : m_tag(tag),
-          m_file_name(location.file_name()),
-          m_line(location.line()),
-          m_start(std::chrono::steady_clock::now()) {
-        log_profiling() << std::format(
-            "START {} @ {}:{}", m_tag, m_file_name, m_line);
+        : m_tag(tag), m_file_name(location.file_name()), m_line(location.line()) {
+        start();
+    }
+
+    // Times the scope of a log_profile() site, feeding its statistics
+    // instead of logging when ProfileMode::Aggregate is set.
+    explicit ScopeLogger(const detail::ProfileSite& site)
+        : m_site(&site),
+          m_aggregate(detail::profile_aggregating()),
+          m_tag(site.tag),
+          m_file_name(site.file),
+          m_line(static_cast<std::uint32_t>(site.line)) {
+        if (m_aggregate) {
+            m_node = detail::profile_enter(site);
+            m_start = detail::ProfileTimer::instance().now();
+        } else {
+            start();
+        }
     }
 
     ~ScopeLogger() noexcept {
-        auto now = std::chrono::steady_clock::now();
-        auto elapsed_us =
-            std::chrono::duration_cast<std::chrono::microseconds>(now - m_start)
-                .count();
-        double                 duration_ms = elapsed_us / 1000.0;
+        const std::uint64_t now = detail::ProfileTimer::instance().now();
+        const std::uint64_t elapsed = now > m_start ? now - m_start : 0;
+        if (m_site && detail::trace_active()) detail::trace_add(*m_site, m_start, elapsed);
+        if (m_aggregate) {
+            detail::profile_record(*m_site, m_node, elapsed, now);
+            return;
+        }
+        const double           duration_ms = static_cast<double>(elapsed) / 1e6;
+        const std::size_t      depth = --detail::scope_depth();
         const std::string_view leave_message =
             (std::uncaught_exceptions() == 0) ? "FINISH" : "EXCEPTION!";
-        log_profiling() << std::format("{} {} ({:0.3f}ms) @ {}:{}",
-                                       leave_message,
-                                       m_tag,
-                                       duration_ms,
-                                       m_file_name,
-                                       m_line);
+        log_profiling().format("{:{}}{} {} ({:0.6f}ms) @ {}:{}",
+                               "",
+                               2 * depth,
+                               leave_message,
+                               m_tag,
+                               duration_ms,
+                               m_file_name,
+                               m_line);
     }
 
     ScopeLogger(const ScopeLogger&) = delete;
@@ -154,18 +759,57 @@ class ScopeLogger {
     ScopeLogger& operator=(ScopeLogger&&) = default;
 
   private:
-    std::string_view                      m_tag;
-    std::string_view                      m_file_name;
-    uint32_t                              m_line;
-    std::chrono::steady_clock::time_point m_start;
+    // Logs the START line, indented by the number of enclosing scopes; the
+    // scope is timed from after it. The depth is counted even when Profile
+    // is filtered out, since the destructor always takes it back.
+    void start() {
+        const std::size_t depth = detail::scope_depth()++;
+        log_profiling().format("{:{}}START {} @ {}:{}", "", 2 * depth, m_tag, m_file_name, m_line);
+        m_start = detail::ProfileTimer::instance().now();
+    }
+
+    const detail::ProfileSite* m_site = nullptr; // null for the tag constructor
+    detail::ScopeNode*         m_node = nullptr; // in the thread's call tree, or null
+    bool                       m_aggregate = false;
+    std::string_view           m_tag;
+    std::string_view           m_file_name;
+    uint32_t                   m_line;
+    std::uint64_t              m_start = 0; // ProfileTimer nanoseconds
 };
 
-#ifdef NDEBUG
+#if LOG_COMPILE_LEVEL > LOG_LEVEL_DEBUG
 #define log_profile(tag)
 #else
 #define CONCAT_IMPL(x, y) x##y
 #define CONCAT(x, y) CONCAT_IMPL(x, y)
-#define log_profile(...) log::ScopeLogger CONCAT(_scopelogger_, __LINE__) { #__VA_ARGS__ }
+#define log_profile(...)                                                                \
+    static constexpr std::source_location CONCAT(_profilelocation_, __LINE__) =         \
+        std::source_location::current();                                                \
+    static const log::detail::ProfileSite CONCAT(_profilesite_, __LINE__){              \
+        #__VA_ARGS__,                                                                   \
+        CONCAT(_profilelocation_, __LINE__).file_name(),                                \
+        static_cast<int>(CONCAT(_profilelocation_, __LINE__).line())};                  \
+    log::ScopeLogger CONCAT(_scopelogger_, __LINE__) { CONCAT(_profilesite_, __LINE__) }
 #endif
 
 } // namespace log
+
+// Format specifications apply to the result of the call.
+template <typename F>
+struct std::formatter<log::Lazy<F>>
+    : std::formatter<std::remove_cvref_t<std::invoke_result_t<const F&>>> {
+    template <typename Context> auto format(const log::Lazy<F>& value, Context& context) const {
+        return std::formatter<std::remove_cvref_t<std::invoke_result_t<const F&>>>::format(
+            value.call(), context);
+    }
+};
+
+template <typename F>
+struct std::formatter<log::DeferredLazy<F>>
+    : std::formatter<std::remove_cvref_t<std::invoke_result_t<const F&>>> {
+    template <typename Context>
+    auto format(const log::DeferredLazy<F>& value, Context& context) const {
+        return std::formatter<std::remove_cvref_t<std::invoke_result_t<const F&>>>::format(
+            value(), context);
+    }
+};
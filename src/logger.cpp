@@ -0,0 +1,15 @@
+/*
+ * logger.cpp
+ * Copyright (c) 2025 João Pedro Foscarini
+ * SPDX-License-Identifier: MIT
+ *
+ * This file is licensed under the MIT License.
+ * You may obtain a copy of the license at:
+ * https://opensource.org/licenses/MIT
+ */
+
+// The backend of the logger library, built with LOG_COMPILED_LIB so that the
+// headers only declare it. Nothing in it depends on LOG_COMPILE_LEVEL, which
+// only the log macros in the programs' own code check.
+
+#include "logger_backend.hpp"
@@ -0,0 +1,121 @@
+/*
+ * scope_allocations.cpp
+ * Copyright (c) 2025 João Pedro Foscarini
+ * SPDX-License-Identifier: MIT
+ *
+ * This file is licensed under the MIT License.
+ * You may obtain a copy of the license at:
+ * https://opensource.org/licenses/MIT
+ */
+
+// Checks that log_profile() scopes of the C++11 header do not allocate in
+// synchronous mode, whether their lines are written, filtered out or
+// aggregated. Exits non-zero and names the case otherwise.
+
+// Release builds define NDEBUG, which would strip the scopes under test.
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+
+#include "logger_cpp11.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+namespace {
+
+std::atomic<unsigned long long> allocations(0);
+
+} // namespace
+
+// GCC takes the malloc() below for a mismatch with the delete operators.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *data = std::malloc(size != 0 ? size : 1))
+    return data;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *data) noexcept { std::free(data); }
+void operator delete(void *data, std::size_t) noexcept { std::free(data); }
+
+namespace {
+
+// Formats every record like a file sink and drops the bytes.
+class NullSink : public log::Sink {
+public:
+  NullSink() : lines(0) {}
+
+  void write(const log::Record &record) {
+    format(m_line, record, false);
+    m_line.clear();
+    ++lines;
+  }
+
+  unsigned long long lines;
+
+private:
+  log::detail::LineBuffer m_line;
+};
+
+void inner() { log_profile(inner); }
+
+void outer() {
+  log_profile(outer);
+  inner();
+}
+
+void tagged() { log::ScopeLogger scope("tagged", __FILE__, __LINE__); }
+
+// Runs a case a few times unmeasured, so that sites, categories and the
+// thread's buffers are in place, then counts the allocations of the rest.
+bool check(const char *name, void (*call)()) {
+  const int warmup = 16;
+  const int calls = 1000;
+  for (int i = 0; i < warmup; ++i)
+    call();
+  unsigned long long before = allocations.load();
+  for (int i = 0; i < calls; ++i)
+    call();
+  unsigned long long count = allocations.load() - before;
+  if (count == 0)
+    return true;
+  std::fprintf(stderr, "%s: %llu allocations in %d scopes\n", name, count,
+               calls);
+  return false;
+}
+
+} // namespace
+
+int main() {
+  std::shared_ptr<NullSink> sink = std::make_shared<NullSink>();
+  log::clear_sinks();
+  log::add_sink(sink);
+
+  bool ok = true;
+  ok = check("lines", outer) && ok;
+  ok = check("tagged", tagged) && ok;
+  if (sink->lines == 0) {
+    std::fprintf(stderr, "lines: no START or FINISH line was written\n");
+    ok = false;
+  }
+
+  log::set_level(log::Level::Info);
+  ok = check("filtered", outer) && ok;
+  log::set_level(log::Level::Trace);
+
+  log::set_profile_mode(log::ProfileMode::Aggregate);
+  ok = check("aggregate", outer) && ok;
+  log::set_profile_mode(log::ProfileMode::Lines);
+
+  if (log::detail::scope_depth() != 0) {
+    std::fprintf(stderr, "scope depth is %llu after all scopes closed\n",
+                 static_cast<unsigned long long>(log::detail::scope_depth()));
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
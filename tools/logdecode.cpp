@@ -0,0 +1,47 @@
+/*
+ * logdecode.cpp
+ * Copyright (c) 2025 João Pedro Foscarini
+ * SPDX-License-Identifier: MIT
+ *
+ * This file is licensed under the MIT License.
+ * You may obtain a copy of the license at:
+ * https://opensource.org/licenses/MIT
+ */
+
+// Renders a binary log written with log::AsyncOptions::binary_file as text.
+//
+//   g++ -std=c++11 -I. tools/logdecode.cpp -o logdecode
+//   ./logdecode [-p ms|us|ns] app.logb
+
+#include "logger_cpp11.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+int main(int argc, char **argv) {
+  int arg = 1;
+  if (arg + 1 < argc && std::strcmp(argv[arg], "-p") == 0) {
+    const char *precision = argv[arg + 1];
+    if (std::strcmp(precision, "us") == 0)
+      log::set_timestamp_precision(log::TimestampPrecision::Microseconds);
+    else if (std::strcmp(precision, "ns") == 0)
+      log::set_timestamp_precision(log::TimestampPrecision::Nanoseconds);
+    arg += 2;
+  }
+  if (arg + 1 != argc) {
+    std::cerr << "usage: " << argv[0] << " [-p ms|us|ns] file\n";
+    return 2;
+  }
+
+  std::ifstream in(argv[arg], std::ios::binary);
+  if (!in) {
+    std::cerr << argv[0] << ": cannot open " << argv[arg] << '\n';
+    return 1;
+  }
+  if (!log::decode_binary(in, std::cout)) {
+    std::cerr << argv[0] << ": " << argv[arg] << " is not a valid binary log\n";
+    return 1;
+  }
+  return 0;
+}